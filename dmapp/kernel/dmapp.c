@@ -6,20 +6,152 @@
  */
 
 #include <linux/cdev.h>
+#include <linux/debugfs.h>
 #include <linux/dma-buf.h>
 #include <linux/dma-fence.h>
+#include <linux/dma-fence-array.h>
+#include <linux/dma-heap.h>
 #include <linux/dma-mapping.h>
+#include <linux/dma-resv.h>
+#include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/genalloc.h>
+#include <linux/hrtimer.h>
+#include <linux/huge_mm.h>
+#include <linux/idr.h>
+#include <linux/interrupt.h>
 #include <linux/ioctl.h>
+#include <linux/kthread.h>
+#include <linux/log2.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/pfn_t.h>
 #include <linux/platform_device.h>
+#include <linux/sched/signal.h>
+#include <linux/seq_file.h>
+#include <linux/shmem_fs.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
 #include <linux/spinlock.h>
+#include <linux/sync_file.h>
 #include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/version.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <drm/drm_fourcc.h>
 
 #define DMAPP_BUFFER_SIZE 10
+#define DMAPP_BUFFER_SIZE_MAX (1 << 24)
+#define DMAPP_MAX_CHANNELS 16
+#define DMAPP_TILES_MAX 8
+#define DMAPP_DAMAGE_HISTORY 8
+#define DMAPP_SUB_ORDER 6
+#define DMAPP_SUB_BASE PAGE_SIZE
+#define DMAPP_LAYOUT_ALIGN 64
+#define DMAPP_LAYOUT_DIM_MAX 16384
+#define DMAPP_BLOCK_WIDTH 64
+#define DMAPP_BLOCK_HEIGHT 64
+#define DMAPP_BLOCK_SIZE (DMAPP_BLOCK_WIDTH * DMAPP_BLOCK_HEIGHT)
+
+/* Since 6.2 dma_buf_vmap and dma_buf_map_attachment must be called with the
+ * reservation lock of the dma-buf held and the _unlocked variants take it
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 2, 0)
+#define dma_buf_vmap_unlocked dma_buf_vmap
+#define dma_buf_vunmap_unlocked dma_buf_vunmap
+#define dma_buf_map_attachment_unlocked dma_buf_map_attachment
+#define dma_buf_unmap_attachment_unlocked dma_buf_unmap_attachment
+#endif
+
+/* Since 6.3 the vma flags may only be changed with vm_flags_set/clear */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+#define dmapp_vm_flags_set(vma, flags) ((vma)->vm_flags |= (flags))
+#define dmapp_vm_flags_clear(vma, flags) ((vma)->vm_flags &= ~(flags))
+#else
+#define dmapp_vm_flags_set vm_flags_set
+#define dmapp_vm_flags_clear vm_flags_clear
+#endif
 
 static struct class *dmapp_class;
+static struct dentry *dmapp_debugfs;
+
+/* Each channel is an independent dmapp device with its own buffer */
+static unsigned int dmapp_channels = 1;
+module_param_named(channels, dmapp_channels, uint, 0444);
+MODULE_PARM_DESC(channels, "Number of dmapp devices (1-16)");
+
+static unsigned int dmapp_buffer_size = DMAPP_BUFFER_SIZE;
+module_param_named(buffer_size, dmapp_buffer_size, uint, 0444);
+MODULE_PARM_DESC(buffer_size, "Buffer size in ints (1-16777216)");
+
+/* Tiles allow the peer to begin reading parts of the buffer before the
+ * lock holder unlocks the whole buffer
+ */
+static unsigned int dmapp_tiles = 1;
+module_param_named(tiles, dmapp_tiles, uint, 0444);
+MODULE_PARM_DESC(tiles, "Number of tiles with their own fences per buffer (1-8)");
+
+/* Hybrid wait: busy-poll the fence for up to spin_us before sleeping. The
+ * adaptive mode sizes the budget from recent wait times and skips the
+ * spin phase when the peer is usually slower than the budget.
+ */
+static unsigned int dmapp_spin_us;
+module_param_named(spin_us, dmapp_spin_us, uint, 0644);
+MODULE_PARM_DESC(spin_us, "Fence spin budget in microseconds (0 = always sleep)");
+
+static bool dmapp_spin_adaptive;
+module_param_named(spin_adaptive, dmapp_spin_adaptive, bool, 0644);
+MODULE_PARM_DESC(spin_adaptive, "Adapt the spin budget to recent wait times");
+
+/* Unlock may defer signaling the peer to simulate device completion. The
+ * completion "interrupt" fires from an hrtimer after signal_delay_us and
+ * the fence is then signaled from the selected context.
+ */
+#define DMAPP_SIGNAL_DIRECT 0
+#define DMAPP_SIGNAL_HRTIMER 1
+#define DMAPP_SIGNAL_TASKLET 2
+#define DMAPP_SIGNAL_WORKQUEUE 3
+#define DMAPP_SIGNAL_KTHREAD 4
+#define DMAPP_SIGNAL_COUNT 5
+
+static unsigned int dmapp_signal_mode;
+module_param_named(signal_mode, dmapp_signal_mode, uint, 0644);
+MODULE_PARM_DESC(signal_mode, "Unlock signaling context (0 = direct, "
+	"1 = hrtimer, 2 = tasklet, 3 = workqueue, 4 = rt kthread)");
+
+static unsigned int dmapp_signal_delay_us;
+module_param_named(signal_delay_us, dmapp_signal_delay_us, uint, 0644);
+MODULE_PARM_DESC(signal_delay_us, "Simulated completion latency in microseconds");
+
+/* The dmapp heap lets any dma-heap user allocate dmapp buffers. Released
+ * buffers are kept in a pool (up to heap_pool buffers) to be recycled by
+ * later allocations of the same size. Heaps cannot be removed so the
+ * module may not be unloaded once the heap is registered.
+ *
+ * Upstream kernels do not export dma_heap_add and dma_heap_get_drvdata to
+ * modules so the heap is only built with DMAPP_HEAP=1 for kernels which
+ * do (e.g. Android GKI kernels).
+ */
+#ifdef DMAPP_HEAP
+static bool dmapp_heap_enable;
+module_param_named(heap, dmapp_heap_enable, bool, 0444);
+MODULE_PARM_DESC(heap, "Register /dev/dma_heap/dmapp (prevents unloading)");
+#endif
+
+/* Huge page buffers are built from naturally aligned 2MB chunks and are
+ * mapped into user space with PMD entries so that scanning a large frame
+ * needs a TLB entry per 2MB rather than per 4KB
+ */
+static bool dmapp_huge_pages;
+module_param_named(huge_pages, dmapp_huge_pages, bool, 0444);
+MODULE_PARM_DESC(huge_pages, "Back buffers with 2MB pages mapped by PMD entries");
+
+static unsigned int dmapp_heap_pool = 8;
+module_param_named(heap_pool, dmapp_heap_pool, uint, 0644);
+MODULE_PARM_DESC(heap_pool, "Number of released heap buffers to keep for reuse");
 
 #define DMAPP_IOC_MAGIC 'd'
 #define DMAPP_IOCTL_GET_BUFFER_SIZE _IO(DMAPP_IOC_MAGIC, 1)
@@ -27,9 +159,525 @@ static struct class *dmapp_class;
 #define DMAPP_IOCTL_GET_BUFFER_PARITY _IO(DMAPP_IOC_MAGIC, 3)
 #define DMAPP_IOCTL_BUFFER_LOCK _IO(DMAPP_IOC_MAGIC, 4)
 #define DMAPP_IOCTL_BUFFER_UNLOCK _IO(DMAPP_IOC_MAGIC, 5)
+#define DMAPP_IOCTL_BUFFER_SWAP _IO(DMAPP_IOC_MAGIC, 6)
+#define DMAPP_IOCTL_BUFFER_LOCK_TIMEOUT _IOW(DMAPP_IOC_MAGIC, 7, \
+	struct dmapp_lock_args)
+#define DMAPP_IOCTL_BUFFER_SWAP_TIMEOUT _IOW(DMAPP_IOC_MAGIC, 8, \
+	struct dmapp_lock_args)
+
+/* Bounds the lock wait to timeout_ns (negative waits forever and zero
+ * only polls) and hints the signaler that the buffer is needed by the
+ * absolute CLOCK_MONOTONIC deadline_ns (zero for no deadline).
+ */
+struct dmapp_lock_args {
+	__s64 timeout_ns;
+	__s64 deadline_ns;
+};
+
+#define DMAPP_IOCTL_WAIT_MULTI _IOWR(DMAPP_IOC_MAGIC, 9, \
+	struct dmapp_wait_multi_args)
+
+#define DMAPP_WAIT_MULTI_MAX 32
+#define DMAPP_WAIT_MULTI_ANY 0x1
+#define DMAPP_WAIT_MULTI_LOCK 0x2
+
+/* Waits for all (or any with DMAPP_WAIT_MULTI_ANY) of the fds which may
+ * be dmapp devices (waiting for our next turn) or sync_file fences. The
+ * signaled bitmask reports which entries are ready and the ready dmapp
+ * devices are also locked when DMAPP_WAIT_MULTI_LOCK is set. The locked
+ * bitmask reports the devices locked by the call and is copied back even
+ * when the ioctl fails so that the caller is able to unlock them.
+ */
+struct dmapp_wait_multi_args {
+	__s32 fds[DMAPP_WAIT_MULTI_MAX];
+	__u32 count;
+	__u32 flags;
+	__s64 timeout_ns;
+	__u32 signaled;
+	__u32 locked;
+};
+
+#define DMAPP_IOCTL_JOB_SUBMIT _IOWR(DMAPP_IOC_MAGIC, 10, struct dmapp_job_args)
+
+#define DMAPP_JOB_FILL 0
+#define DMAPP_JOB_COPY 1
+#define DMAPP_JOB_INCREMENT 2
+#define DMAPP_JOB_CHECKSUM 3
+
+#define DMAPP_JOB_UNLOCK 0x1
+
+#define DMAPP_JOB_PRIORITY_NORMAL 0
+#define DMAPP_JOB_PRIORITY_HIGH 1
+#define DMAPP_JOB_PRIORITY_LOW 2
+#define DMAPP_JOB_PRIORITY_COUNT 3
+
+#define DMAPP_JOB_MAX_DEPS 8
+
+/* Jobs are executed by the kernel engine on the buffer of the dmapp device
+ * that the ioctl was issued on (dst) and optionally the buffer of another
+ * dmapp device (src_fd or -1 for the same device). Offsets and count are
+ * in ints where a count of zero extends to the end of the buffer.
+ *
+ * FILL: dst[i] = value
+ * COPY: dst[i] = src[i]
+ * INCREMENT: dst[i] += value
+ * CHECKSUM: dst[dst_offset] = sum(src[i])
+ *
+ * The caller must hold the dst lock and, when src_fd is given, the lock (or
+ * read lock) of src_fd until the job completes. With DMAPP_JOB_UNLOCK, the
+ * dst lock is handed to the engine which signals the peer once the job
+ * completes.
+ * The fence_fd returns a sync_file that signals on completion.
+ *
+ * Jobs become ready once the fences of all dep_fds (sync_files or dmapp
+ * devices) signal and ready jobs are dispatched in priority order where
+ * a zero priority is NORMAL.
+ */
+struct dmapp_job_args {
+	__u32 op;
+	__u32 flags;
+	__s32 src_fd;
+	__u32 src_offset;
+	__u32 dst_offset;
+	__u32 count;
+	__s32 value;
+	__s32 fence_fd;
+	__u32 priority;
+	__u32 num_deps;
+	__s32 dep_fds[DMAPP_JOB_MAX_DEPS];
+};
+
+#define DMAPP_IOCTL_FORWARD _IOW(DMAPP_IOC_MAGIC, 11, struct dmapp_forward_args)
+
+#define DMAPP_FORWARD_OP 0x1
+#define DMAPP_FORWARD_STOP 0x2
+
+/* Register the caller as an in-kernel relay stage. Each time the turn of
+ * the caller arrives the kernel locks the buffer, optionally applies op
+ * (a DMAPP_JOB_* op on the caller's buffer with src == dst) and then
+ * unlocks the buffer to signal the peer without returning to user space.
+ *
+ * Forwarding continues until DMAPP_FORWARD_STOP or the file is closed and
+ * the lock ioctls and job submission fail with EBUSY in the meantime.
+ */
+struct dmapp_forward_args {
+	__u32 flags;
+	__u32 op;
+	__s32 value;
+	__u32 offset;
+	__u32 count;
+	__u32 pad;
+};
+
+#define DMAPP_IOCTL_TILE_UNLOCK _IOWR(DMAPP_IOC_MAGIC, 12, struct dmapp_tile_args)
+#define DMAPP_IOCTL_TILE_WAIT _IOWR(DMAPP_IOC_MAGIC, 13, struct dmapp_tile_args)
+
+/* The buffer is split into tiles of whole ints where each tile has its
+ * own fence. The lock holder may TILE_UNLOCK a tile once it has been
+ * written so that the peer may TILE_WAIT and begin reading the tile
+ * before the whole buffer is unlocked. Unlock signals any remaining tiles.
+ *
+ * Both ioctls return the number of tiles and the range of the tile (in
+ * ints). TILE_WAIT waits for the tile of the caller's next turn where a
+ * negative timeout_ns waits forever.
+ */
+struct dmapp_tile_args {
+	__u32 tile;
+	__u32 tiles;
+	__u32 offset;
+	__u32 count;
+	__s64 timeout_ns;
+};
+
+#define DMAPP_IOCTL_READ_LOCK _IOWR(DMAPP_IOC_MAGIC, 14, struct dmapp_read_args)
+#define DMAPP_IOCTL_READ_UNLOCK _IO(DMAPP_IOC_MAGIC, 15)
+
+/* Files opened O_RDONLY are shared readers rather than parity users. Each
+ * frame that a writer unlocks arms a read fence for every reader and the
+ * next writer lock waits until all readers have unlocked the frame.
+ * READ_LOCK waits for a frame that the reader has not yet read and returns
+ * its frame number where a negative timeout_ns waits forever.
+ */
+struct dmapp_read_args {
+	__s64 timeout_ns;
+	__u64 frame;
+};
+
+#define DMAPP_LOCK_MULTI_MAX 8
+
+#define DMAPP_IOCTL_LOCK_MULTI _IOW(DMAPP_IOC_MAGIC, 16, \
+	struct dmapp_lock_multi_args)
+
+/* Lock the buffers of a set of dmapp device fds (which need not include
+ * the fd of the ioctl) in one call. The buffer reservations are acquired
+ * together (with ww_mutex backoff) and the turns of all fds are checked
+ * while holding them. A pending turn drops every reservation and is
+ * awaited before retrying so that a stage never holds one buffer while it
+ * waits for another. The unlock fence of each buffer is added as its write
+ * fence. Either all buffers are locked or none are. Each buffer is
+ * unlocked individually. A negative timeout_ns waits forever.
+ */
+struct dmapp_lock_multi_args {
+	__s32 fds[DMAPP_LOCK_MULTI_MAX];
+	__u32 count;
+	__u32 flags;
+	__s64 timeout_ns;
+};
+
+#define DMAPP_IOCTL_RING_INIT _IO(DMAPP_IOC_MAGIC, 17)
+#define DMAPP_IOCTL_RING_WAIT _IOW(DMAPP_IOC_MAGIC, 18, struct dmapp_ring_wait_args)
+#define DMAPP_IOCTL_RING_WAKE _IO(DMAPP_IOC_MAGIC, 19)
+
+#define DMAPP_RING_HEAD 0
+#define DMAPP_RING_TAIL 1
+
+/* Streaming mode lays a single producer single consumer ring over the
+ * buffer. The producer owns head and the consumer owns tail where both
+ * are free running byte counts and the data (a power of two size bytes)
+ * begins at the first page boundary after the header so that it may be
+ * mapped with the mirrored mapping. Indices are published with release stores and read
+ * with acquire loads so that steady state streaming never enters the
+ * kernel.
+ *
+ * The kernel is only a doorbell. A side which finds the ring full or
+ * empty sets its waiting flag, issues a full barrier, checks the index
+ * again and then sleeps with RING_WAIT until the index differs from
+ * value. After publishing an index the peer issues a full barrier and
+ * calls RING_WAKE only if the waiting flag of the other side is set.
+ *
+ * RING_INIT resets the header and returns size. The caller must hold the
+ * buffer lock so that the peer may lock the buffer to learn that the ring
+ * is ready. The buffer must span at least two pages (e.g. a buffer_size
+ * module parameter of at least 2048 ints with 4KB pages) or RING_INIT
+ * fails with -ENOSPC. RING_WAIT and RING_WAKE fail with -EINVAL until the
+ * ring is initialized and RING_WAIT also fails when value is more than a
+ * ring away from the index which the caller owns.
+ */
+struct dmapp_ring {
+	__u32 head;
+	__u32 head_waiting;
+	__u32 pad0[14];
+	__u32 tail;
+	__u32 tail_waiting;
+	__u32 pad1[14];
+	__u32 size;
+	__u32 pad2[15];
+};
+
+struct dmapp_ring_wait_args {
+	__u32 index;
+	__u32 value;
+	__s64 timeout_ns;
+};
+
+#define DMAPP_DAMAGE_MAX 8
+#define DMAPP_DAMAGE_ALL 0x1
+
+#define DMAPP_IOCTL_SET_DAMAGE _IOW(DMAPP_IOC_MAGIC, 20, struct dmapp_damage_args)
+#define DMAPP_IOCTL_GET_DAMAGE _IOR(DMAPP_IOC_MAGIC, 21, struct dmapp_damage_args)
+
+struct dmapp_damage_range {
+	__u32 offset;
+	__u32 count;
+};
+
+/* Damage ranges (in ints) describe the parts of the buffer that changed.
+ * The lock holder calls SET_DAMAGE before unlocking to describe its pass
+ * (a pass without damage is assumed to change the whole buffer). After a
+ * lock (or READ_LOCK) GET_DAMAGE returns the union of the damage of every
+ * pass since the caller's previous lock, coalesced to at most
+ * DMAPP_DAMAGE_MAX ranges, or DMAPP_DAMAGE_ALL when the history does not
+ * reach back far enough.
+ */
+struct dmapp_damage_args {
+	__u32 count;
+	__u32 flags;
+	struct dmapp_damage_range ranges[DMAPP_DAMAGE_MAX];
+};
+
+#define DMAPP_IOCTL_IMPORT _IOW(DMAPP_IOC_MAGIC, 22, struct dmapp_import_args)
+
+/* Replace the buffer of the dmapp device with a dma-buf from another
+ * exporter (e.g. a dma-heap, udmabuf or vgem) which is attached to the
+ * dmapp device and then shared with the same lock protocol. The buffer
+ * size becomes the size of the dma-buf (in whole ints) and a negative fd
+ * restores the buffer of the dmapp device. The device must be idle (no
+ * user or reader holds the lock and no relay is registered).
+ */
+struct dmapp_import_args {
+	__s32 fd;
+	__u32 flags;
+};
+
+#define DMAPP_IOCTL_USERPTR _IOW(DMAPP_IOC_MAGIC, 23, struct dmapp_userptr_args)
+
+/* Pin a page aligned range of the caller's memory, export it as a dma-buf
+ * and import it as the buffer of the dmapp device (see DMAPP_IOCTL_IMPORT)
+ * so that an existing allocation joins the pipeline without a copy. The
+ * pages stay pinned until the dma-buf is released.
+ */
+struct dmapp_userptr_args {
+	__u64 addr;
+	__u64 size;
+	__u32 flags;
+	__u32 pad;
+};
+
+#define DMAPP_IOCTL_MEMFD _IOW(DMAPP_IOC_MAGIC, 24, struct dmapp_memfd_args)
+
+/* Export a page aligned range of a sealed memfd as a dma-buf and import
+ * it as the buffer of the dmapp device so that the frames are reachable
+ * through both the dma-buf and the memfd (e.g. with mmap, read or
+ * sendfile). The memfd must be sealed with F_SEAL_SHRINK and must not be
+ * sealed with F_SEAL_WRITE.
+ */
+struct dmapp_memfd_args {
+	__s32 memfd;
+	__u32 flags;
+	__u64 offset;
+	__u64 size;
+};
+
+#define DMAPP_IOCTL_SET_NODE _IOW(DMAPP_IOC_MAGIC, 25, struct dmapp_node_args)
+#define DMAPP_IOCTL_GET_NODE _IOR(DMAPP_IOC_MAGIC, 26, struct dmapp_node_args)
+
+#define DMAPP_NODE_MIXED 0x1
+
+/* SET_NODE replaces the buffer of the dmapp device (which must be idle)
+ * with a new zeroed buffer of the same size on the NUMA node (or the node
+ * of the calling CPU when node is negative) so that the stage which calls
+ * it is close to its frames. The frame contents and any imported buffer
+ * are discarded and the call fails rather than fall back to another node.
+ * GET_NODE reports the node of the buffer (or -1 when the node of an
+ * imported buffer is unknown) so that schedulers may co-locate stages with
+ * their memory and sets DMAPP_NODE_MIXED when the pages of the buffer span
+ * several nodes (in which case node is that of the first page).
+ */
+struct dmapp_node_args {
+	__s32 node;
+	__u32 flags;
+};
+
+#define DMAPP_IOCTL_SUB_ALLOC _IOWR(DMAPP_IOC_MAGIC, 27, struct dmapp_sub_args)
+#define DMAPP_IOCTL_SUB_FREE _IOW(DMAPP_IOC_MAGIC, 28, struct dmapp_sub_args)
+#define DMAPP_IOCTL_SUB_SIGNAL _IOWR(DMAPP_IOC_MAGIC, 29, struct dmapp_sub_args)
+#define DMAPP_IOCTL_SUB_WAIT _IOWR(DMAPP_IOC_MAGIC, 30, struct dmapp_sub_args)
+
+/* Many small buffers may be carved out of the buffer of the dmapp device
+ * so that they share one dma-buf and one mapping. SUB_ALLOC reserves size
+ * bytes (in 64 byte units so that suballocations never share a cache line)
+ * and returns a handle and the byte offset of the suballocation.
+ *
+ * Each suballocation has its own fence timeline. SUB_SIGNAL publishes the
+ * suballocation and returns its new seqno. SUB_WAIT waits until the seqno
+ * of the suballocation passes seqno (where a negative timeout_ns waits
+ * forever) and returns the current seqno. SUB_FREE wakes any waiters with
+ * ECANCELED. The buffer may not be replaced while suballocations exist.
+ *
+ * Suballocations belong to the file which allocated them and are freed
+ * when it is closed. Only the owner may signal or free a suballocation
+ * while any user may wait for it.
+ */
+struct dmapp_sub_args {
+	__u32 handle;
+	__u32 offset;
+	__u32 size;
+	__u32 flags;
+	__u64 seqno;
+	__s64 timeout_ns;
+};
+
+#define DMAPP_IOCTL_SET_LAYOUT _IOWR(DMAPP_IOC_MAGIC, 31, struct dmapp_layout_args)
+#define DMAPP_IOCTL_GET_LAYOUT _IOR(DMAPP_IOC_MAGIC, 32, struct dmapp_layout_args)
+
+#define DMAPP_PLANES_MAX 4
+
+struct dmapp_plane {
+	__u32 offset;
+	__u32 stride;
+};
+
+/* SET_LAYOUT replaces the buffer of the dmapp device (which must be idle)
+ * with a buffer which holds a width x height image of a DRM fourcc format
+ * (R8, RGB565, XRGB8888, ARGB8888, NV12, NV16, P010 or YUV420). When
+ * num_planes is zero the plane offsets and strides are computed so that
+ * every row of every plane starts on an align byte boundary (64 bytes
+ * when align is zero) and are returned. Otherwise the offsets and strides
+ * of all planes of the format are given and must be multiples of align.
+ *
+ * The BLOCKED flag stores each plane as 64 byte x 64 row blocks (4KB
+ * each) in row-major block order with row-major bytes within each block so
+ * that 2D neighborhoods share few cache lines and pages. Strides are then
+ * multiples of 64 bytes, the plane heights are padded to 64 rows and the
+ * plane offsets are multiples of the block size. The byte at (x, y) of a
+ * plane is at offset + (y / 64 * stride / 64 + x / 64) * 4096 +
+ * (y % 64) * 64 + x % 64.
+ * The buffer size in bytes is returned in size and the buffer size in
+ * ints is returned by the ioctl. GET_LAYOUT reports the layout (where a
+ * zero format is a plain array of ints) and any other buffer change
+ * resets the layout except for SET_NODE which keeps it.
+ */
+#define DMAPP_LAYOUT_BLOCKED 0x1
+
+struct dmapp_layout_args {
+	__u32 width;
+	__u32 height;
+	__u32 format;
+	__u32 flags;
+	__u32 align;
+	__u32 num_planes;
+	__u32 size;
+	__u32 pad;
+	struct dmapp_plane planes[DMAPP_PLANES_MAX];
+};
+
+#define DMAPP_IOCTL_BUFFER_UNLOCK_META _IOW(DMAPP_IOC_MAGIC, 33, \
+	struct dmapp_meta_args)
+
+#define DMAPP_META_DATA_SIZE 40
+
+/* UNLOCK_META publishes a small per-frame record (e.g. sequence numbers,
+ * timestamps or flags along with up to 40 bytes of data) and then unlocks
+ * the buffer. A zero timestamp_ns is replaced by the time of the unlock
+ * and frame is set to the seqno which the unlock signals. The records are
+ * kept in a read-only metadata page (mapped at DMAPP_MMAP_META) apart
+ * from the payload so that consumers decide whether to drop or skip a
+ * frame without touching the buffer. After locking the buffer the user
+ * with parity p reads meta[1 - p] which is current when its frame equals
+ * signaled[p] of the seqno page (read with acquire semantics before the
+ * record) and which does not change until the lock holder unlocks.
+ */
+struct dmapp_meta_args {
+	__u64 frame;
+	__u64 timestamp_ns;
+	__u32 flags;
+	__u32 size;
+	__u8 data[DMAPP_META_DATA_SIZE];
+};
+
+/* Offset of the metadata page of the dmapp device */
+#define DMAPP_MMAP_META 0x20000000
+
+/* Read-only page with one cache line record per parity */
+struct dmapp_meta_page {
+	struct dmapp_meta_args meta[2];
+};
+
+/* Offset of the mirrored mapping of the dmapp device. Mapping 2 * len
+ * bytes at DMAPP_MMAP_MIRROR + offset maps len bytes of the buffer
+ * (starting at the page aligned offset) twice back-to-back so that any
+ * record up to len bytes of a circular stream is contiguous.
+ */
+#define DMAPP_MMAP_MIRROR 0x40000000
+
+/* Read-only page mapped by user space (offset 0 of the dmapp device) to
+ * check whether its turn has come without entering the kernel. A user
+ * with parity p may lock the buffer without blocking once
+ * signaled[p] >= pending[p].
+ */
+struct dmapp_seqno_page {
+	__u64 signaled[2];
+	__u64 pending[2];
+};
+
+/* UNLOCK_DAMAGE sets the damage of the pass (as SET_DAMAGE) and then
+ * unlocks the buffer with a single ioctl
+ */
+#define DMAPP_IOCTL_BUFFER_UNLOCK_DAMAGE _IOW(DMAPP_IOC_MAGIC, 34, \
+	struct dmapp_damage_args)
+
+struct dmapp_wait_stats {
+	u64 waits;
+	u64 timeouts;
+	u64 spin_hits;
+	u64 spin_misses;
+	u64 sleeps;
+	u64 avg_wait_ns;
+	u64 budget_ns;
+};
+
+/* Latency histograms use log2 buckets of microseconds */
+#define DMAPP_LATENCY_BUCKETS 16
+
+struct dmapp_latency_stats {
+	u64 count;
+	u64 total_ns;
+	u64 max_ns;
+	u64 hist[DMAPP_LATENCY_BUCKETS];
+};
+
+struct dmapp_signal_stats {
+	struct dmapp_latency_stats irq_to_signal;
+	struct dmapp_latency_stats signal_to_wakeup;
+};
+
+struct dmapp_signal;
+
+struct dmapp_signaler {
+	spinlock_t lock;
+	struct list_head tasklet_list;
+	struct list_head work_list;
+	struct list_head kthread_list;
+	struct tasklet_struct tasklet;
+	struct work_struct work;
+	struct task_struct *kthread;
+	struct dmapp_signal_stats stats[DMAPP_SIGNAL_COUNT];
+	u64 deadline_boosts;
+	u64 deadline_misses;
+};
+
+static struct dmapp_signaler dmapp_signaler;
 
 struct dmapp_user;
 
+struct dmapp_job_dep {
+	struct dma_fence_cb cb;
+	struct dma_fence *fence;
+	struct dmapp_job *job;
+};
+
+struct dmapp_job {
+	struct list_head node;
+	struct dmapp_job_args args;
+	struct dmapp_job_dep deps[DMAPP_JOB_MAX_DEPS];
+	atomic_t pending;
+	struct dmapp_device *dmapp_dev;
+	struct dma_buf *dst_buf;
+	struct dma_buf *src_buf;
+	struct dma_fence *out_fence;
+	struct dma_fence *unlock_fence;
+	int unlock_parity;
+	ktime_t submit_time;
+	ktime_t ready_time;
+};
+
+struct dmapp_engine_stats {
+	u64 submitted;
+	u64 completed;
+	u64 failed;
+	u64 blocked;
+	u64 ready;
+	u64 total_queue_ns;
+	u64 total_latency_ns;
+	u64 max_latency_ns;
+};
+
+/* Software processing engine which emulates a hardware queue. Jobs wait
+ * for their dependencies with fence callbacks on the blocked list and
+ * ready jobs are executed in priority order.
+ */
+struct dmapp_engine {
+	spinlock_t lock;
+	spinlock_t fence_lock;
+	struct list_head blocked;
+	struct list_head ready[DMAPP_JOB_PRIORITY_COUNT];
+	struct workqueue_struct *wq;
+	struct work_struct work;
+	struct dmapp_engine_stats stats[DMAPP_JOB_PRIORITY_COUNT];
+};
+
+static struct dmapp_engine dmapp_engine;
+
 struct dmapp_device {
 	struct cdev cdev;
 	struct device *device;
@@ -37,12 +685,107 @@ struct dmapp_device {
 	spinlock_t spinlock;
 	struct dmapp_user *user[2];
 	struct dma_fence *fence[2];
+	u64 context;
+	u64 seqno[2];
+	u32 tiles;
+	u64 tile_context;
+	struct dma_fence *tile_fence[2][DMAPP_TILES_MAX];
+	struct list_head readers;
+	u64 frame;
+	wait_queue_head_t frame_wq;
+	wait_queue_head_t ring_wq;
+	u32 size;
+	struct dmapp_damage_args damage[DMAPP_DAMAGE_HISTORY];
+	struct dmapp_seqno_page *seqno_page;
+	struct dmapp_meta_page *meta_page;
+	struct dmapp_wait_stats wait_stats;
+	atomic_t signals_pending;
+	wait_queue_head_t signals_wq;
+	struct dentry *debugfs;
 	struct dma_buf *buf;
+	struct dma_buf *own_buf;
+	struct dma_buf_attachment *import_attach;
+	struct sg_table *import_sgt;
+	struct iosys_map map;
+	struct mutex sub_lock;
+	struct gen_pool *sub_pool;
+	struct idr subs;
+	u32 sub_count;
+	struct dmapp_layout_args layout;
+};
+
+struct dmapp_sub {
+	struct dmapp_user *owner;
+	u32 offset;
+	u32 size;
+	u64 context;
+	u64 seqno;
+	struct dma_fence *fence;
+};
+
+/* In-kernel relay where the turn fence callback queues work to lock,
+ * process and unlock the buffer and then rearms on the next turn. The
+ * relay waits for its turn and then for the readers of the last frame
+ * with fence callbacks so that the work never sleeps on the engine.
+ */
+struct dmapp_forward {
+	struct dma_fence_cb cb;
+	struct work_struct work;
+	struct mutex lock;
+	struct dmapp_user *user;
+	struct dma_fence *fence;
+	struct dmapp_job *job;
+	int parity;
+	bool stop;
+	u64 count;
 };
 
 struct dmapp_user {
 	struct dmapp_device *dmapp_dev;
+	struct dmapp_forward *forward;
 	bool is_locked;
+
+	/* Frames seen at the previous and current lock */
+	u64 damage_since;
+	u64 damage_frame;
+
+	/* Shared reader state */
+	bool is_reader;
+	struct list_head node;
+	struct dma_fence *read_fence;
+	struct dma_fence *read_spare;
+	u64 read_context;
+	u64 armed_frame;
+	u64 frame;
+};
+
+static void dmapp_forward_stop(struct dmapp_forward *forward);
+static void dmapp_buf_node(struct dmapp_device *dmapp_dev,
+	struct dmapp_node_args *args);
+static void dmapp_get_layout(struct dmapp_device *dmapp_dev,
+	struct dmapp_layout_args *args);
+static void dmapp_sub_release_user(struct dmapp_user *user);
+
+/* Deadline hints pull a pending deferred signal forward and the signal
+ * mode is tracked to measure the signal to wakeup latency. The deadline
+ * and signal are protected by the fence lock.
+ */
+struct dmapp_fence {
+	struct dma_fence base;
+	ktime_t deadline;
+	struct dmapp_signal *signal;
+	int signal_mode;
+};
+
+/* Deferred signal of a peer fence */
+struct dmapp_signal {
+	struct list_head node;
+	struct hrtimer timer;
+	struct dmapp_device *dmapp_dev;
+	struct dma_fence *fence;
+	int parity;
+	int mode;
+	ktime_t irq_time;
 };
 
 struct dmapp_buffer {
@@ -50,285 +793,4571 @@ struct dmapp_buffer {
 	dma_addr_t paddr;
 	size_t size;
 	struct device *dev;
+	bool from_heap;
+	struct list_head node;
+	struct page **chunks;
+	unsigned int nchunks;
+	unsigned int chunk_order;
 };
 
-static struct sg_table *dmapp_buf_map(struct dma_buf_attachment *attachment,
-	enum dma_data_direction dir) {
-	struct dmapp_buffer *buffer = attachment->dmabuf->priv;
-	struct sg_table *sgt;
-
-	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
-	if (!sgt) {
-		return ERR_PTR(-ENOMEM);
-	}
+#define DMAPP_CHUNK_ORDER_PMD (PMD_SHIFT - PAGE_SHIFT)
 
-	if (sg_alloc_table(sgt, 1, GFP_KERNEL)) {
-		goto err_sg_alloc_table;
-	}
-
-	sg_set_page(sgt->sgl, virt_to_page(buffer->vaddr), buffer->size, 0);
+/* Pages of a userptr (pinned) or memfd (referenced) dma-buf */
+struct dmapp_pages {
+	struct page **pages;
+	unsigned long npages;
+	struct file *memfd;
+};
 
-	if (dma_map_sg(attachment->dev, sgt->sgl, sgt->nents, dir) == 0) {
-		goto err_dma_map_sg;
-	}
+struct dmapp_heap_stats {
+	u64 allocs;
+	u64 pool_hits;
+	u64 pooled;
+};
 
-	return sgt;
+struct dmapp_heap {
+	struct mutex lock;
+	struct list_head pool;
+	struct device *dev;
+	struct dma_heap *heap;
+	struct dmapp_heap_stats stats;
+};
 
-err_dma_map_sg:
-	sg_free_table(sgt);
-err_sg_alloc_table:
-	kfree(sgt);
-	return ERR_PTR(-ENOMEM);
-}
+static struct dmapp_heap dmapp_heap;
 
-static void dmapp_buf_unmap(struct dma_buf_attachment *attachment,
-	struct sg_table *sgt, enum dma_data_direction dir) {
-	dma_unmap_sg(attachment->dev, sgt->sgl, sgt->nents, dir);
-	sg_free_table(sgt);
-	kfree(sgt);
+/* Size of the buffer allocated for size bytes */
+static size_t dmapp_buffer_align(size_t size) {
+	return dmapp_huge_pages ? ALIGN(size, PMD_SIZE) : PAGE_ALIGN(size);
 }
 
-static void dmapp_buf_release(struct dma_buf *dmabuf) {
-	struct dmapp_buffer *buffer = dmabuf->priv;
-	dma_free_coherent(buffer->dev, buffer->size, buffer->vaddr, buffer->paddr);
-	kfree(buffer);
-}
+static void dmapp_buffer_free_chunks(struct dmapp_buffer *buffer) {
+	unsigned int i;
 
-static int dmapp_buf_begin_cpu_access(struct dma_buf *dmabuf,
-	enum dma_data_direction dir) {
-	struct dmapp_buffer *buffer = dmabuf->priv;
-	dma_sync_single_for_cpu(buffer->dev, buffer->paddr, buffer->size, dir);
-	return 0;
+	for (i = 0; i < buffer->nchunks; ++i) {
+		if (buffer->chunks[i]) {
+			__free_pages(buffer->chunks[i], buffer->chunk_order);
+		}
+	}
+	kvfree(buffer->chunks);
 }
 
-static int dmapp_buf_end_cpu_access(struct dma_buf *dmabuf,
-	enum dma_data_direction dir) {
-	struct dmapp_buffer *buffer = dmabuf->priv;
-	dma_sync_single_for_device(buffer->dev, buffer->paddr, buffer->size, dir);
-	return 0;
+static size_t dmapp_buffer_chunk_size(struct dmapp_buffer *buffer) {
+	return PAGE_SIZE << buffer->chunk_order;
 }
 
-static struct dma_buf_ops dmapp_dmabuf_ops = {
-	.map_dma_buf = dmapp_buf_map,
-	.unmap_dma_buf = dmapp_buf_unmap,
-	.release = dmapp_buf_release,
-	.begin_cpu_access = dmapp_buf_begin_cpu_access,
-	.end_cpu_access = dmapp_buf_end_cpu_access,
-};
-
-static int dmapp_cdev_open(struct inode *inode, struct file *file) {
-	struct dmapp_device *dmapp_dev;
-	struct dmapp_user *user;
-	int parity;
+/* Chunks are allocated from node (or the local node for NUMA_NO_NODE) */
+static int dmapp_buffer_alloc_chunks(struct dmapp_buffer *buffer, int node) {
+	unsigned int order = buffer->chunk_order;
+	unsigned long npages = buffer->size >> PAGE_SHIFT;
+	gfp_t gfp = GFP_KERNEL | __GFP_ZERO | __GFP_COMP | __GFP_NOWARN;
+	struct page **pages;
+	unsigned long i;
 
-	dmapp_dev = container_of(inode->i_cdev, struct dmapp_device, cdev);
+	/* A requested node must not silently fall back to another node */
+	if (node != NUMA_NO_NODE) {
+		gfp |= __GFP_THISNODE;
+	}
 
-	user = kzalloc(sizeof(*user), GFP_KERNEL);
-	if (!user) {
+	buffer->nchunks = buffer->size >> (PAGE_SHIFT + order);
+	buffer->chunks = kvcalloc(buffer->nchunks, sizeof(*buffer->chunks),
+		GFP_KERNEL);
+	if (!buffer->chunks) {
 		return -ENOMEM;
 	}
 
-	spin_lock(&dmapp_dev->spinlock);
+	/* Buddy pages of PMD order are naturally aligned */
+	for (i = 0; i < buffer->nchunks; ++i) {
+		buffer->chunks[i] = alloc_pages_node(node, gfp, order);
+		if (!buffer->chunks[i]) {
+			goto err_chunks;
+		}
+	}
 
-	/* Assign parity to user */
-	if (dmapp_dev->user[0] == NULL) {
-		parity = 0;
-	} else if (dmapp_dev->user[1] == NULL) {
-		parity = 1;
-	} else {
-		spin_unlock(&dmapp_dev->spinlock);
-		pr_err("dmapp_cdev_open: invalid user\n");
-		goto err_user;
+	/* The kernel mapping is contiguous for the engine and the ring */
+	pages = kvmalloc_array(npages, sizeof(*pages), GFP_KERNEL);
+	if (!pages) {
+		goto err_chunks;
+	}
+	for (i = 0; i < npages; ++i) {
+		pages[i] = nth_page(buffer->chunks[i >> order],
+			i & ((1UL << order) - 1));
+	}
+	buffer->vaddr = vmap(pages, npages, VM_MAP, PAGE_KERNEL);
+	kvfree(pages);
+	if (!buffer->vaddr) {
+		goto err_chunks;
 	}
 
-	user->dmapp_dev = dmapp_dev;
-	dmapp_dev->user[parity] = user;
+	return 0;
 
-	spin_unlock(&dmapp_dev->spinlock);
+err_chunks:
+	dmapp_buffer_free_chunks(buffer);
+	return -ENOMEM;
+}
 
-	file->private_data = user;
+/* Buffers are coherent allocations unless huge pages or a NUMA node are
+ * requested in which case they are built from page chunks
+ */
+static struct dmapp_buffer *dmapp_buffer_alloc(struct device *dev,
+	size_t size, int node) {
+	struct dmapp_buffer *buffer;
 
-	pr_info("dmapp_cdev_open: success\n");
+	buffer = kzalloc(sizeof(*buffer), GFP_KERNEL);
+	if (!buffer) {
+		return NULL;
+	}
 
-	return 0;
+	buffer->size = dmapp_buffer_align(size);
+	buffer->dev = dev;
+	INIT_LIST_HEAD(&buffer->node);
 
-err_user:
-	kfree(user);
-	return -EINVAL;
-}
+	if (dmapp_huge_pages || (node != NUMA_NO_NODE)) {
+		buffer->chunk_order = dmapp_huge_pages ? DMAPP_CHUNK_ORDER_PMD : 0;
+		if (dmapp_buffer_alloc_chunks(buffer, node) < 0) {
+			kfree(buffer);
+			return NULL;
+		}
+		return buffer;
+	}
 
-static int dmapp_cdev_release(struct inode *inode, struct file *file) {
+	/* Large coherent allocations are served from CMA when available */
+	buffer->vaddr = dma_alloc_coherent(dev, buffer->size, &buffer->paddr,
+		GFP_KERNEL);
+	if (!buffer->vaddr) {
+		kfree(buffer);
+		return NULL;
+	}
+
+	return buffer;
+}
+
+static void dmapp_buffer_free(struct dmapp_buffer *buffer) {
+	if (buffer->chunks) {
+		vunmap(buffer->vaddr);
+		dmapp_buffer_free_chunks(buffer);
+	} else {
+		dma_free_coherent(buffer->dev, buffer->size, buffer->vaddr,
+			buffer->paddr);
+	}
+	kfree(buffer);
+}
+
+static unsigned long dmapp_buffer_pfn(struct dmapp_buffer *buffer,
+	unsigned long offset) {
+	size_t chunk_size = dmapp_buffer_chunk_size(buffer);
+
+	if (buffer->chunks) {
+		return page_to_pfn(buffer->chunks[offset / chunk_size]) +
+			((offset & (chunk_size - 1)) >> PAGE_SHIFT);
+	}
+	return page_to_pfn(virt_to_page(buffer->vaddr + offset));
+}
+
+/* The node of the first page represents the buffer and mixed is set when
+ * any other page lives on another node
+ */
+static int dmapp_buffer_node(struct dmapp_buffer *buffer, bool *mixed) {
+	unsigned long offset;
+	unsigned int i;
+	int node;
+
+	if (buffer->chunks) {
+		node = page_to_nid(buffer->chunks[0]);
+		for (i = 1; i < buffer->nchunks; ++i) {
+			if (page_to_nid(buffer->chunks[i]) != node) {
+				*mixed = true;
+				break;
+			}
+		}
+		return node;
+	}
+
+	node = page_to_nid(virt_to_page(buffer->vaddr));
+	for (offset = PAGE_SIZE; offset < buffer->size; offset += PAGE_SIZE) {
+		if (page_to_nid(virt_to_page(buffer->vaddr + offset)) != node) {
+			*mixed = true;
+			break;
+		}
+	}
+	return node;
+}
+
+/* Map size bytes of the buffer at offset to addr with 4KB entries */
+static int dmapp_buffer_remap(struct vm_area_struct *vma, unsigned long addr,
+	struct dmapp_buffer *buffer, unsigned long offset, unsigned long size) {
+	unsigned long len;
+	int ret;
+
+	while (size) {
+		/* Chunked buffers are only contiguous within each chunk */
+		len = size;
+		if (buffer->chunks) {
+			len = min(size, dmapp_buffer_chunk_size(buffer) -
+				(offset & (dmapp_buffer_chunk_size(buffer) - 1)));
+		}
+
+		ret = remap_pfn_range(vma, addr, dmapp_buffer_pfn(buffer, offset),
+			len, vma->vm_page_prot);
+		if (ret < 0) {
+			return ret;
+		}
+
+		addr += len;
+		offset += len;
+		size -= len;
+	}
+
+	return 0;
+}
+
+static vm_fault_t dmapp_huge_fault(struct vm_fault *vmf,
+	enum page_entry_size pe_size) {
+	struct vm_area_struct *vma = vmf->vma;
+	struct dmapp_buffer *buffer = vma->vm_private_data;
+	unsigned long addr = vmf->address & PMD_MASK;
+	unsigned long offset;
+
+	if ((pe_size != PE_SIZE_PMD) ||
+		(buffer->chunk_order != DMAPP_CHUNK_ORDER_PMD)) {
+		return VM_FAULT_FALLBACK;
+	}
+
+	/* Fall back to 4KB entries where the vma does not cover a whole
+	 * chunk at a PMD aligned address
+	 */
+	offset = addr - vma->vm_start + (vma->vm_pgoff << PAGE_SHIFT);
+	if ((addr < vma->vm_start) || (addr + PMD_SIZE > vma->vm_end) ||
+		(offset & ~PMD_MASK) || (offset + PMD_SIZE > buffer->size)) {
+		return VM_FAULT_FALLBACK;
+	}
+
+	return vmf_insert_pfn_pmd(vmf,
+		__pfn_to_pfn_t(dmapp_buffer_pfn(buffer, offset), PFN_DEV),
+		vmf->flags & FAULT_FLAG_WRITE);
+}
+
+static vm_fault_t dmapp_huge_fault_pte(struct vm_fault *vmf) {
+	struct vm_area_struct *vma = vmf->vma;
+	struct dmapp_buffer *buffer = vma->vm_private_data;
+	unsigned long offset = vmf->pgoff << PAGE_SHIFT;
+
+	if (offset >= buffer->size) {
+		return VM_FAULT_SIGBUS;
+	}
+
+	return vmf_insert_pfn(vma, vmf->address,
+		dmapp_buffer_pfn(buffer, offset));
+}
+
+static const struct vm_operations_struct dmapp_huge_vm_ops = {
+	.fault = dmapp_huge_fault_pte,
+	.huge_fault = dmapp_huge_fault,
+};
+
+/* Returns true when the buffer was kept in the heap pool */
+static bool dmapp_heap_recycle(struct dmapp_heap *heap,
+	struct dmapp_buffer *buffer) {
+	bool recycled = false;
+
+	mutex_lock(&heap->lock);
+	if (heap->stats.pooled < READ_ONCE(dmapp_heap_pool)) {
+		list_add(&buffer->node, &heap->pool);
+		++heap->stats.pooled;
+		recycled = true;
+	}
+	mutex_unlock(&heap->lock);
+
+	return recycled;
+}
+
+static struct sg_table *dmapp_buf_map(struct dma_buf_attachment *attachment,
+	enum dma_data_direction dir) {
+	struct dmapp_buffer *buffer = attachment->dmabuf->priv;
+	struct scatterlist *sg;
+	struct sg_table *sgt;
+	unsigned int i;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt) {
+		return ERR_PTR(-ENOMEM);
+	}
+
+	if (buffer->chunks) {
+		if (sg_alloc_table(sgt, buffer->nchunks, GFP_KERNEL)) {
+			goto err_sg_alloc_table;
+		}
+
+		for_each_sgtable_sg(sgt, sg, i) {
+			sg_set_page(sg, buffer->chunks[i],
+				dmapp_buffer_chunk_size(buffer), 0);
+		}
+	} else {
+		if (sg_alloc_table(sgt, 1, GFP_KERNEL)) {
+			goto err_sg_alloc_table;
+		}
+
+		sg_set_page(sgt->sgl, virt_to_page(buffer->vaddr), buffer->size, 0);
+	}
+
+	if (dma_map_sg(attachment->dev, sgt->sgl, sgt->nents, dir) == 0) {
+		goto err_dma_map_sg;
+	}
+
+	return sgt;
+
+err_dma_map_sg:
+	sg_free_table(sgt);
+err_sg_alloc_table:
+	kfree(sgt);
+	return ERR_PTR(-ENOMEM);
+}
+
+static void dmapp_buf_unmap(struct dma_buf_attachment *attachment,
+	struct sg_table *sgt, enum dma_data_direction dir) {
+	dma_unmap_sg(attachment->dev, sgt->sgl, sgt->nents, dir);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static void dmapp_buf_release(struct dma_buf *dmabuf) {
+	struct dmapp_buffer *buffer = dmabuf->priv;
+
+	if (buffer->from_heap && dmapp_heap_recycle(&dmapp_heap, buffer)) {
+		return;
+	}
+	dmapp_buffer_free(buffer);
+}
+
+/* Huge page buffers are cached memory which is synchronized with the
+ * devices when the attachments are mapped
+ */
+static int dmapp_buf_begin_cpu_access(struct dma_buf *dmabuf,
+	enum dma_data_direction dir) {
+	struct dmapp_buffer *buffer = dmabuf->priv;
+	if (!buffer->chunks) {
+		dma_sync_single_for_cpu(buffer->dev, buffer->paddr, buffer->size, dir);
+	}
+	return 0;
+}
+
+static int dmapp_buf_end_cpu_access(struct dma_buf *dmabuf,
+	enum dma_data_direction dir) {
+	struct dmapp_buffer *buffer = dmabuf->priv;
+	if (!buffer->chunks) {
+		dma_sync_single_for_device(buffer->dev, buffer->paddr, buffer->size,
+			dir);
+	}
+	return 0;
+}
+
+static int dmapp_buf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma) {
+	struct dmapp_buffer *buffer = dmabuf->priv;
+
+	/* Private mappings would need copy-on-write of the pfn entries */
+	if (!(vma->vm_flags & VM_SHARED)) {
+		return -EINVAL;
+	}
+
+	if (buffer->chunks) {
+		/* Populated on demand so that whole huge chunks use PMD entries */
+		dmapp_vm_flags_set(vma, VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP |
+			VM_HUGEPAGE);
+		vma->vm_ops = &dmapp_huge_vm_ops;
+		vma->vm_private_data = buffer;
+		return 0;
+	}
+
+	return dma_mmap_coherent(buffer->dev, vma, buffer->vaddr, buffer->paddr,
+		buffer->size);
+}
+
+static int dmapp_buf_vmap(struct dma_buf *dmabuf, struct iosys_map *map) {
+	struct dmapp_buffer *buffer = dmabuf->priv;
+	iosys_map_set_vaddr(map, buffer->vaddr);
+	return 0;
+}
+
+static struct dma_buf_ops dmapp_dmabuf_ops = {
+	.map_dma_buf = dmapp_buf_map,
+	.unmap_dma_buf = dmapp_buf_unmap,
+	.mmap = dmapp_buf_mmap,
+	.vmap = dmapp_buf_vmap,
+	.release = dmapp_buf_release,
+	.begin_cpu_access = dmapp_buf_begin_cpu_access,
+	.end_cpu_access = dmapp_buf_end_cpu_access,
+};
+
+/* The buffer may be replaced by an import so users of the buffer outside
+ * of the spinlock must hold a reference
+ */
+static struct dma_buf *dmapp_buf_get(struct dmapp_device *dmapp_dev) {
+	struct dma_buf *buf;
+
+	spin_lock_irq(&dmapp_dev->spinlock);
+	buf = dmapp_dev->buf;
+	get_dma_buf(buf);
+	spin_unlock_irq(&dmapp_dev->spinlock);
+
+	return buf;
+}
+
+/* As dmapp_buf_get but also snapshot the size (in ints) of the buffer */
+static struct dma_buf *dmapp_buf_get_size(struct dmapp_device *dmapp_dev,
+	size_t *size) {
+	struct dma_buf *buf;
+
+	spin_lock_irq(&dmapp_dev->spinlock);
+	buf = dmapp_dev->buf;
+	get_dma_buf(buf);
+	*size = dmapp_dev->size;
+	spin_unlock_irq(&dmapp_dev->spinlock);
+
+	return buf;
+}
+
+#ifdef DMAPP_HEAP
+static struct dmapp_buffer *dmapp_heap_pool_get(struct dmapp_heap *heap,
+	size_t size) {
+	struct dmapp_buffer *buffer;
+
+	mutex_lock(&heap->lock);
+	++heap->stats.allocs;
+	list_for_each_entry(buffer, &heap->pool, node) {
+		if (buffer->size == size) {
+			list_del_init(&buffer->node);
+			--heap->stats.pooled;
+			++heap->stats.pool_hits;
+			mutex_unlock(&heap->lock);
+			return buffer;
+		}
+	}
+	mutex_unlock(&heap->lock);
+
+	return NULL;
+}
+
+static struct dma_buf *dmapp_heap_allocate(struct dma_heap *dma_heap,
+	unsigned long len, unsigned long fd_flags, unsigned long heap_flags) {
+	struct dmapp_heap *heap = dma_heap_get_drvdata(dma_heap);
+	struct dmapp_buffer *buffer;
+	struct dma_buf *dmabuf;
+	size_t size = dmapp_buffer_align(len);
+	struct dma_buf_export_info exp_info = {
+		.exp_name = "dmapp_heap",
+	};
+
+	buffer = dmapp_heap_pool_get(heap, size);
+	if (buffer) {
+		/* Recycled buffers may hold the frames of another process */
+		memset(buffer->vaddr, 0, buffer->size);
+	} else {
+		buffer = dmapp_buffer_alloc(heap->dev, size, NUMA_NO_NODE);
+		if (!buffer) {
+			return ERR_PTR(-ENOMEM);
+		}
+		buffer->from_heap = true;
+	}
+
+	exp_info.ops = &dmapp_dmabuf_ops;
+	exp_info.size = buffer->size;
+	exp_info.flags = fd_flags;
+	exp_info.priv = buffer;
+
+	dmabuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dmabuf)) {
+		pr_err("dmapp_heap_allocate: dma_buf_export failed\n");
+		dmapp_buffer_free(buffer);
+	}
+
+	return dmabuf;
+}
+
+static const struct dma_heap_ops dmapp_heap_ops = {
+	.allocate = dmapp_heap_allocate,
+};
+#endif
+
+static const char *dmapp_fence_get_driver_name(struct dma_fence *fence)
+{
+	return "dmapp";
+}
+
+static const char *dmapp_fence_get_timeline_name(struct dma_fence *fence)
+{
+	return "dmapp_timeline";
+}
+
+static void dmapp_fence_set_deadline(struct dma_fence *fence,
+	ktime_t deadline) {
+	struct dmapp_fence *dmapp_fence = container_of(fence, struct dmapp_fence,
+		base);
+	struct dmapp_signal *signal;
+	unsigned long flags;
+	bool boosted = false;
+
+	/* Keep the earliest deadline requested by any waiter */
+	spin_lock_irqsave(fence->lock, flags);
+	if (!dmapp_fence->deadline ||
+		ktime_before(deadline, dmapp_fence->deadline)) {
+		dmapp_fence->deadline = deadline;
+	}
+
+	/* Complete a pending deferred signal by the deadline rather than after
+	 * the full signal delay unless its timer callback is already running
+	 */
+	signal = dmapp_fence->signal;
+	if (signal && ktime_before(dmapp_fence->deadline,
+		hrtimer_get_expires(&signal->timer)) &&
+		(hrtimer_try_to_cancel(&signal->timer) == 1)) {
+		hrtimer_start(&signal->timer, dmapp_fence->deadline,
+			HRTIMER_MODE_ABS);
+		boosted = true;
+	}
+	spin_unlock_irqrestore(fence->lock, flags);
+
+	if (boosted) {
+		spin_lock_irqsave(&dmapp_signaler.lock, flags);
+		dmapp_signaler.deadline_boosts++;
+		spin_unlock_irqrestore(&dmapp_signaler.lock, flags);
+	}
+}
+
+/* Deadlines set by foreign waiters (e.g. on a sync_file of a job) reach
+ * the fence through dma_fence_set_deadline which was added in 6.4
+ */
+static const struct dma_fence_ops dmapp_fence_ops = {
+	.get_driver_name = dmapp_fence_get_driver_name,
+	.get_timeline_name = dmapp_fence_get_timeline_name,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+	.set_deadline = dmapp_fence_set_deadline,
+#endif
+};
+
+static struct dma_fence *dmapp_fence_alloc(void) {
+	struct dmapp_fence *dmapp_fence;
+
+	dmapp_fence = kzalloc(sizeof(*dmapp_fence), GFP_KERNEL);
+	if (!dmapp_fence) {
+		return NULL;
+	}
+
+	return &dmapp_fence->base;
+}
+
+static int dmapp_cdev_open(struct inode *inode, struct file *file) {
+	struct dmapp_device *dmapp_dev;
+	struct dmapp_user *user;
+	int parity;
+
+	dmapp_dev = container_of(inode->i_cdev, struct dmapp_device, cdev);
+
+	user = kzalloc(sizeof(*user), GFP_KERNEL);
+	if (!user) {
+		return -ENOMEM;
+	}
+
+	user->dmapp_dev = dmapp_dev;
+
+	/* Read-only users share the buffer with other readers */
+	if ((file->f_flags & O_ACCMODE) == O_RDONLY) {
+		user->is_reader = true;
+		user->read_context = dma_fence_context_alloc(1);
+		user->read_spare = dmapp_fence_alloc();
+		if (!user->read_spare) {
+			kfree(user);
+			return -ENOMEM;
+		}
+
+		spin_lock_irq(&dmapp_dev->spinlock);
+		user->frame = dmapp_dev->frame;
+		list_add_tail(&user->node, &dmapp_dev->readers);
+		spin_unlock_irq(&dmapp_dev->spinlock);
+
+		file->private_data = user;
+
+		pr_info("dmapp_cdev_open: reader success\n");
+
+		return 0;
+	}
+
+	spin_lock_irq(&dmapp_dev->spinlock);
+
+	/* Assign parity to user */
+	if (dmapp_dev->user[0] == NULL) {
+		parity = 0;
+	} else if (dmapp_dev->user[1] == NULL) {
+		parity = 1;
+	} else {
+		spin_unlock_irq(&dmapp_dev->spinlock);
+		pr_err("dmapp_cdev_open: invalid user\n");
+		goto err_user;
+	}
+
+	dmapp_dev->user[parity] = user;
+
+	spin_unlock_irq(&dmapp_dev->spinlock);
+
+	file->private_data = user;
+
+	pr_info("dmapp_cdev_open: success\n");
+
+	return 0;
+
+err_user:
+	kfree(user);
+	return -EINVAL;
+}
+
+/* Initialize the next fence on the timeline of parity and publish its
+ * seqno as pending. The caller must hold the spinlock.
+ */
+static void dmapp_fence_init_locked(struct dmapp_device *dmapp_dev,
+	int parity, struct dma_fence *fence) {
+	dma_fence_init(fence, &dmapp_fence_ops, &dmapp_dev->spinlock,
+		dmapp_dev->context + parity, ++dmapp_dev->seqno[parity]);
+	WRITE_ONCE(dmapp_dev->seqno_page->pending[parity], fence->seqno);
+}
+
+/* Allocate the tile fences for the next turn of a user */
+static int dmapp_tiles_alloc(struct dmapp_device *dmapp_dev,
+	struct dma_fence **tiles) {
+	u32 i;
+
+	for (i = 0; i < dmapp_dev->tiles; ++i) {
+		tiles[i] = dmapp_fence_alloc();
+		if (!tiles[i]) {
+			/* The fences were not initialized so they are not put */
+			while (i--) {
+				kfree(container_of(tiles[i], struct dmapp_fence, base));
+			}
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+/* Install the tile fences for the turn of parity that ends with fence and
+ * return the previous tile fences in tiles. The caller must hold the
+ * spinlock.
+ */
+static void dmapp_tiles_init_locked(struct dmapp_device *dmapp_dev,
+	int parity, struct dma_fence *fence, struct dma_fence **tiles) {
+	struct dma_fence *old;
+	u32 i;
+
+	for (i = 0; i < dmapp_dev->tiles; ++i) {
+		dma_fence_init(tiles[i], &dmapp_fence_ops, &dmapp_dev->spinlock,
+			dmapp_dev->tile_context + parity * DMAPP_TILES_MAX + i,
+			fence->seqno);
+		old = dmapp_dev->tile_fence[parity][i];
+		dmapp_dev->tile_fence[parity][i] = tiles[i];
+		tiles[i] = old;
+	}
+}
+
+static void dmapp_tiles_put(struct dmapp_device *dmapp_dev,
+	struct dma_fence **tiles) {
+	u32 i;
+
+	for (i = 0; i < dmapp_dev->tiles; ++i) {
+		dma_fence_put(tiles[i]);
+	}
+}
+
+/* Signal the tiles that remain for the turn of parity. The caller must
+ * hold the spinlock.
+ */
+static void dmapp_tiles_signal_locked(struct dmapp_device *dmapp_dev,
+	int parity) {
+	u32 i;
+
+	/* Tiles which were unlocked already are left as they are */
+	for (i = 0; i < dmapp_dev->tiles; ++i) {
+		dma_fence_signal_locked(dmapp_dev->tile_fence[parity][i]);
+	}
+}
+
+/* Publish a frame to the readers by arming their read fences so that the
+ * next writer waits until each reader has unlocked the frame. Readers
+ * without a spare fence (or which still hold a frame) skip the frame.
+ * The caller must hold the spinlock and wake the frame waiters.
+ */
+static void dmapp_readers_publish_locked(struct dmapp_device *dmapp_dev) {
+	struct dmapp_user *reader;
+
+	dmapp_dev->frame++;
+
+	/* The next pass changes everything unless it sets its damage */
+	dmapp_dev->damage[(dmapp_dev->frame + 1) % DMAPP_DAMAGE_HISTORY] =
+		(struct dmapp_damage_args) { .flags = DMAPP_DAMAGE_ALL };
+
+	list_for_each_entry(reader, &dmapp_dev->readers, node) {
+		if (!reader->read_spare || reader->is_locked) {
+			continue;
+		}
+
+		/* The old fence is signaled so the put does not take the lock */
+		dma_fence_put(reader->read_fence);
+		reader->read_fence = reader->read_spare;
+		reader->read_spare = NULL;
+		dma_fence_init(reader->read_fence, &dmapp_fence_ops,
+			&dmapp_dev->spinlock, reader->read_context, dmapp_dev->frame);
+		reader->armed_frame = dmapp_dev->frame;
+	}
+}
+
+/* Signal a fence on the timeline of parity (and the tiles of the turn that
+ * it guards) and publish its seqno and frame. The frame is only published
+ * when the fence transitions so that a fence which was already signaled
+ * (e.g. by a release) neither counts a frame nor rearms the readers. Both
+ * happen under the fence lock so that the next writer sees the armed read
+ * fences as soon as it sees its turn.
+ */
+static int dmapp_fence_signal(struct dmapp_device *dmapp_dev, int parity,
+	struct dma_fence *fence) {
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&dmapp_dev->spinlock, flags);
+	if (test_bit(DMA_FENCE_FLAG_SIGNALED_BIT, &fence->flags)) {
+		spin_unlock_irqrestore(&dmapp_dev->spinlock, flags);
+		return -EINVAL;
+	}
+
+	dmapp_readers_publish_locked(dmapp_dev);
+	dmapp_tiles_signal_locked(dmapp_dev, parity);
+
+	ret = dma_fence_signal_locked(fence);
+	if (ret == 0) {
+		/* Release the meta record of the unlock to lockless readers */
+		smp_store_release(&dmapp_dev->seqno_page->signaled[parity],
+			fence->seqno);
+	}
+	spin_unlock_irqrestore(&dmapp_dev->spinlock, flags);
+
+	wake_up_all(&dmapp_dev->frame_wq);
+
+	return ret;
+}
+
+static void dmapp_latency_record(struct dmapp_latency_stats *stats,
+	s64 latency_ns) {
+	int bucket;
+
+	if (latency_ns < 0) {
+		latency_ns = 0;
+	}
+
+	bucket = min(fls64(div_u64(latency_ns, NSEC_PER_USEC)),
+		DMAPP_LATENCY_BUCKETS - 1);
+
+	stats->count++;
+	stats->total_ns += latency_ns;
+	stats->max_ns = max(stats->max_ns, (u64) latency_ns);
+	stats->hist[bucket]++;
+}
+
+/* Record the latency from signaling a dmapp fence to the waiter resuming
+ * for fences which were signaled after the wait began
+ */
+static void dmapp_signal_record_wakeup(struct dma_fence *fence,
+	ktime_t start) {
+	struct dmapp_signaler *signaler = &dmapp_signaler;
+	struct dmapp_fence *dmapp_fence;
+	unsigned long flags;
+	s64 latency_ns;
+
+	if ((fence->ops != &dmapp_fence_ops) ||
+		!test_bit(DMA_FENCE_FLAG_TIMESTAMP_BIT, &fence->flags) ||
+		ktime_before(fence->timestamp, start)) {
+		return;
+	}
+
+	dmapp_fence = container_of(fence, struct dmapp_fence, base);
+	latency_ns = ktime_to_ns(ktime_sub(ktime_get(), fence->timestamp));
+
+	spin_lock_irqsave(&signaler->lock, flags);
+	dmapp_latency_record(
+		&signaler->stats[dmapp_fence->signal_mode].signal_to_wakeup,
+		latency_ns);
+	spin_unlock_irqrestore(&signaler->lock, flags);
+}
+
+static void dmapp_signal_complete(struct dmapp_signal *signal) {
+	struct dmapp_signaler *signaler = &dmapp_signaler;
+	struct dmapp_device *dmapp_dev = signal->dmapp_dev;
+	struct dmapp_fence *dmapp_fence = container_of(signal->fence,
+		struct dmapp_fence, base);
+	ktime_t now = ktime_get();
+	unsigned long flags;
+	ktime_t deadline;
+	s64 latency_ns;
+	bool signaled;
+
+	/* A fence which was signaled by a release keeps its mode */
+	spin_lock_irqsave(signal->fence->lock, flags);
+	deadline = dmapp_fence->deadline;
+	signaled = test_bit(DMA_FENCE_FLAG_SIGNALED_BIT, &signal->fence->flags);
+	if (!signaled) {
+		dmapp_fence->signal_mode = signal->mode;
+	}
+	spin_unlock_irqrestore(signal->fence->lock, flags);
+
+	/* Only a signal which completes the fence is recorded */
+	if (!signaled &&
+		(dmapp_fence_signal(dmapp_dev, signal->parity, signal->fence) == 0)) {
+		latency_ns = ktime_to_ns(ktime_sub(now, signal->irq_time));
+		spin_lock_irqsave(&signaler->lock, flags);
+		dmapp_latency_record(&signaler->stats[signal->mode].irq_to_signal,
+			latency_ns);
+		if (deadline && ktime_after(now, deadline)) {
+			signaler->deadline_misses++;
+		}
+		spin_unlock_irqrestore(&signaler->lock, flags);
+	}
+	dma_fence_put(signal->fence);
+	kfree(signal);
+
+	if (atomic_dec_and_test(&dmapp_dev->signals_pending)) {
+		wake_up(&dmapp_dev->signals_wq);
+	}
+}
+
+static void dmapp_signal_drain(struct list_head *list) {
+	struct dmapp_signaler *signaler = &dmapp_signaler;
+	struct dmapp_signal *signal;
+	struct dmapp_signal *tmp;
+	unsigned long flags;
+	LIST_HEAD(signals);
+
+	spin_lock_irqsave(&signaler->lock, flags);
+	list_splice_init(list, &signals);
+	spin_unlock_irqrestore(&signaler->lock, flags);
+
+	list_for_each_entry_safe(signal, tmp, &signals, node) {
+		list_del(&signal->node);
+		dmapp_signal_complete(signal);
+	}
+}
+
+static void dmapp_signal_tasklet(struct tasklet_struct *tasklet) {
+	dmapp_signal_drain(&dmapp_signaler.tasklet_list);
+}
+
+static void dmapp_signal_work(struct work_struct *work) {
+	dmapp_signal_drain(&dmapp_signaler.work_list);
+}
+
+static int dmapp_signal_kthread(void *data) {
+	struct dmapp_signaler *signaler = data;
+	bool empty;
+
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		spin_lock_irq(&signaler->lock);
+		empty = list_empty(&signaler->kthread_list);
+		spin_unlock_irq(&signaler->lock);
+		if (empty) {
+			schedule();
+		}
+		__set_current_state(TASK_RUNNING);
+
+		dmapp_signal_drain(&signaler->kthread_list);
+	}
+
+	return 0;
+}
+
+/* The simulated completion interrupt */
+static enum hrtimer_restart dmapp_signal_timer(struct hrtimer *timer) {
+	struct dmapp_signal *signal = container_of(timer, struct dmapp_signal,
+		timer);
+	struct dmapp_fence *dmapp_fence = container_of(signal->fence,
+		struct dmapp_fence, base);
+	struct dmapp_signaler *signaler = &dmapp_signaler;
+	unsigned long flags;
+
+	signal->irq_time = ktime_get();
+
+	/* The signal may no longer be boosted by a deadline */
+	spin_lock_irqsave(signal->fence->lock, flags);
+	dmapp_fence->signal = NULL;
+	spin_unlock_irqrestore(signal->fence->lock, flags);
+
+	switch (signal->mode) {
+	case DMAPP_SIGNAL_TASKLET:
+		spin_lock_irqsave(&signaler->lock, flags);
+		list_add_tail(&signal->node, &signaler->tasklet_list);
+		spin_unlock_irqrestore(&signaler->lock, flags);
+		tasklet_hi_schedule(&signaler->tasklet);
+		break;
+	case DMAPP_SIGNAL_WORKQUEUE:
+		spin_lock_irqsave(&signaler->lock, flags);
+		list_add_tail(&signal->node, &signaler->work_list);
+		spin_unlock_irqrestore(&signaler->lock, flags);
+		queue_work(system_highpri_wq, &signaler->work);
+		break;
+	case DMAPP_SIGNAL_KTHREAD:
+		spin_lock_irqsave(&signaler->lock, flags);
+		list_add_tail(&signal->node, &signaler->kthread_list);
+		spin_unlock_irqrestore(&signaler->lock, flags);
+		wake_up_process(signaler->kthread);
+		break;
+	default:
+		dmapp_signal_complete(signal);
+	}
+
+	return HRTIMER_NORESTART;
+}
+
+/* Signal the fence on the timeline of parity using the selected signal
+ * mode. Deferred signals hold a fence reference until they complete.
+ */
+static int dmapp_signal(struct dmapp_device *dmapp_dev, int parity,
+	struct dma_fence *fence) {
+	unsigned int mode = READ_ONCE(dmapp_signal_mode);
+	struct dmapp_fence *dmapp_fence = container_of(fence, struct dmapp_fence,
+		base);
+	struct dmapp_signal *signal;
+	bool boosted = false;
+	ktime_t expires;
+
+	if ((mode == DMAPP_SIGNAL_DIRECT) || (mode >= DMAPP_SIGNAL_COUNT)) {
+		dmapp_fence->signal_mode = DMAPP_SIGNAL_DIRECT;
+		return dmapp_fence_signal(dmapp_dev, parity, fence);
+	}
+
+	signal = kzalloc(sizeof(*signal), GFP_KERNEL);
+	if (!signal) {
+		return -ENOMEM;
+	}
+
+	signal->dmapp_dev = dmapp_dev;
+	signal->fence = dma_fence_get(fence);
+	signal->parity = parity;
+	signal->mode = mode;
+	atomic_inc(&dmapp_dev->signals_pending);
+
+	hrtimer_init(&signal->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	signal->timer.function = dmapp_signal_timer;
+
+	/* Complete after the signal delay or by the deadline of a waiter
+	 * (which may also arrive once the timer is running)
+	 */
+	expires = ktime_add_us(ktime_get(), READ_ONCE(dmapp_signal_delay_us));
+	spin_lock_irq(fence->lock);
+	if (dmapp_fence->deadline &&
+		ktime_before(dmapp_fence->deadline, expires)) {
+		expires = dmapp_fence->deadline;
+		boosted = true;
+	}
+	dmapp_fence->signal = signal;
+	hrtimer_start(&signal->timer, expires, HRTIMER_MODE_ABS);
+	spin_unlock_irq(fence->lock);
+
+	if (boosted) {
+		spin_lock_irq(&dmapp_signaler.lock);
+		dmapp_signaler.deadline_boosts++;
+		spin_unlock_irq(&dmapp_signaler.lock);
+	}
+
+	return 0;
+}
+
+static int dmapp_signaler_init(struct dmapp_signaler *signaler) {
+	spin_lock_init(&signaler->lock);
+	INIT_LIST_HEAD(&signaler->tasklet_list);
+	INIT_LIST_HEAD(&signaler->work_list);
+	INIT_LIST_HEAD(&signaler->kthread_list);
+	tasklet_setup(&signaler->tasklet, dmapp_signal_tasklet);
+	INIT_WORK(&signaler->work, dmapp_signal_work);
+
+	signaler->kthread = kthread_run(dmapp_signal_kthread, signaler,
+		"dmapp_signal");
+	if (IS_ERR(signaler->kthread)) {
+		return PTR_ERR(signaler->kthread);
+	}
+	sched_set_fifo(signaler->kthread);
+
+	return 0;
+}
+
+/* Must be called once all devices have drained their pending signals */
+static void dmapp_signaler_destroy(struct dmapp_signaler *signaler) {
+	kthread_stop(signaler->kthread);
+	tasklet_kill(&signaler->tasklet);
+	cancel_work_sync(&signaler->work);
+}
+
+static int dmapp_cdev_release(struct inode *inode, struct file *file) {
+	int ret = 0;
+	struct dmapp_user *user = (struct dmapp_user *) file->private_data;
+	struct dmapp_device *dmapp_dev = user->dmapp_dev;
+	struct dma_fence *signal_fence = NULL;
+	struct dmapp_forward *forward;
+	int signal_parity = -1;
+
+	if (user->is_reader) {
+		spin_lock_irq(&dmapp_dev->spinlock);
+		list_del(&user->node);
+		signal_fence = user->read_fence;
+		spin_unlock_irq(&dmapp_dev->spinlock);
+
+		/* Release a frame that is still held by the reader */
+		if (signal_fence) {
+			dma_fence_signal(signal_fence);
+			dma_fence_put(signal_fence);
+		}
+		if (user->read_spare) {
+			kfree(container_of(user->read_spare, struct dmapp_fence, base));
+		}
+
+		file->private_data = NULL;
+		kfree(user);
+
+		pr_info("dmapp_cdev_release: reader success\n");
+
+		return 0;
+	}
+
+	/* Stop forwarding while the user is still connected */
+	spin_lock_irq(&dmapp_dev->spinlock);
+	forward = user->forward;
+	user->forward = NULL;
+	spin_unlock_irq(&dmapp_dev->spinlock);
+
+	if (forward) {
+		dmapp_forward_stop(forward);
+	}
+
+	dmapp_sub_release_user(user);
+
+	spin_lock_irq(&dmapp_dev->spinlock);
+
+	/* Disconnect the user */
+	if (dmapp_dev->user[0] == user) {
+		dmapp_dev->user[0] = NULL;
+		if (user->is_locked) {
+			signal_parity = 1;
+		}
+	} else if (dmapp_dev->user[1] == user) {
+		dmapp_dev->user[1] = NULL;
+		if (user->is_locked) {
+			signal_parity = 0;
+		}
+	}
+
+	if (signal_parity >= 0) {
+		signal_fence = dma_fence_get(dmapp_dev->fence[signal_parity]);
+	}
+
+	spin_unlock_irq(&dmapp_dev->spinlock);
+
+	file->private_data = NULL;
+	kfree(user);
+
+	/* Optionally reset the signal_fence to prevent deadlocks */
+	if (signal_fence) {
+		if (!dma_fence_is_signaled(signal_fence)) {
+			ret = dmapp_fence_signal(dmapp_dev, signal_parity, signal_fence);
+			if (ret < 0) {
+				/* Signal may fail if the fence was previously signaled */
+				pr_err("dmapp_cdev_release: dma_fence_signal failed (%i)\n", ret);
+			}
+		}
+		dma_fence_put(signal_fence);
+	}
+
+	if (!ret) {
+		pr_info("dmapp_cdev_release: success\n");
+	}
+
+	return ret;
+}
+
+static u64 dmapp_spin_budget(struct dmapp_device *dmapp_dev) {
+	u64 spin_ns = (u64) READ_ONCE(dmapp_spin_us) * NSEC_PER_USEC;
+	u64 avg_wait_ns;
+
+	if (!spin_ns || !dmapp_spin_adaptive) {
+		return spin_ns;
+	}
+
+	/* Spinning is wasted when the peer is usually slower than the budget,
+	 * otherwise allow some headroom over the average wait
+	 */
+	spin_lock_irq(&dmapp_dev->spinlock);
+	avg_wait_ns = dmapp_dev->wait_stats.avg_wait_ns;
+	spin_unlock_irq(&dmapp_dev->spinlock);
+
+	if (avg_wait_ns > spin_ns) {
+		return 0;
+	}
+
+	return min(spin_ns, 2 * avg_wait_ns + NSEC_PER_USEC);
+}
+
+static void dmapp_fence_wait_deadline(struct dma_fence *fence,
+	s64 deadline_ns) {
+	if (deadline_ns <= 0) {
+		return;
+	}
+
+	/* Older kernels lack dma_fence_set_deadline so only dmapp fences
+	 * (which all turn fences are) receive the hint
+	 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+	dma_fence_set_deadline(fence, ns_to_ktime(deadline_ns));
+#else
+	if (fence->ops == &dmapp_fence_ops) {
+		dmapp_fence_set_deadline(fence, ns_to_ktime(deadline_ns));
+	}
+#endif
+}
+
+/* Wait for a fence by spinning for the current budget and then sleeping.
+ * A negative timeout_ns waits forever. Only turn waits of the buffer locks
+ * update the wait statistics (and thereby the adaptive spin budget) since
+ * the other waits depend on readers, tiles or suballocations.
+ */
+static int dmapp_fence_wait(struct dmapp_device *dmapp_dev,
+	struct dma_fence *fence, s64 timeout_ns, bool turn) {
+	struct dmapp_wait_stats *stats = &dmapp_dev->wait_stats;
+	ktime_t start = ktime_get();
+	u64 budget_ns = dmapp_spin_budget(dmapp_dev);
+	bool spin_hit = false;
+	bool timeout = false;
+	u64 wait_ns;
+	long ret = 0;
+
+	if (timeout_ns >= 0) {
+		budget_ns = min(budget_ns, (u64) timeout_ns);
+	}
+
+	if (budget_ns) {
+		ktime_t end = ktime_add_ns(start, budget_ns);
+
+		while (!(spin_hit = dma_fence_is_signaled(fence))) {
+			if (need_resched() || signal_pending(current) ||
+				ktime_after(ktime_get(), end)) {
+				break;
+			}
+			cpu_relax();
+		}
+	}
+
+	if (spin_hit) {
+		/* Nothing to do */
+	} else if (timeout_ns < 0) {
+		ret = dma_fence_wait(fence, true);
+		if (ret < 0) {
+			return ret;
+		}
+	} else {
+		s64 remaining_ns = timeout_ns - ktime_to_ns(ktime_sub(ktime_get(),
+			start));
+		long remaining_jiffies = 0;
+
+		/* Round up so that short timeouts still sleep once */
+		if (remaining_ns > 0) {
+			remaining_jiffies = max_t(long, nsecs_to_jiffies(remaining_ns), 1);
+		}
+
+		ret = dma_fence_wait_timeout(fence, true, remaining_jiffies);
+		if (ret < 0) {
+			return ret;
+		}
+		timeout = (ret == 0);
+	}
+
+	wait_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	if (!timeout) {
+		dmapp_signal_record_wakeup(fence, start);
+	}
+
+	if (!turn) {
+		return timeout ? -ETIMEDOUT : 0;
+	}
+
+	spin_lock_irq(&dmapp_dev->spinlock);
+	stats->waits++;
+	if (timeout) {
+		stats->timeouts++;
+	}
+	if (budget_ns) {
+		if (spin_hit) {
+			stats->spin_hits++;
+		} else {
+			stats->spin_misses++;
+		}
+	}
+	if (!spin_hit && !timeout) {
+		stats->sleeps++;
+	}
+	/* A timed out wait says nothing about how long the peer takes */
+	if (!timeout) {
+		stats->avg_wait_ns = stats->avg_wait_ns -
+			(stats->avg_wait_ns >> 3) + (wait_ns >> 3);
+	}
+	stats->budget_ns = budget_ns;
+	spin_unlock_irq(&dmapp_dev->spinlock);
+
+	return timeout ? -ETIMEDOUT : 0;
+}
+
+/* Returns a reference to the read fence of a reader which still holds the
+ * last frame or NULL. The caller must hold the spinlock.
+ */
+static struct dma_fence *dmapp_readers_pending_locked(
+	struct dmapp_device *dmapp_dev) {
+	struct dmapp_user *reader;
+
+	list_for_each_entry(reader, &dmapp_dev->readers, node) {
+		if (reader->read_fence &&
+			!dma_fence_is_signaled_locked(reader->read_fence)) {
+			return dma_fence_get(reader->read_fence);
+		}
+	}
+
+	return NULL;
+}
+
+/* Wait until the readers have unlocked the last frame. New read fences
+ * are only armed when a frame is published so the writer is not starved.
+ */
+static int dmapp_readers_wait(struct dmapp_device *dmapp_dev,
+	s64 timeout_ns) {
+	struct dma_fence *fence;
+	int ret;
+
+	while (1) {
+		spin_lock_irq(&dmapp_dev->spinlock);
+		fence = dmapp_readers_pending_locked(dmapp_dev);
+		spin_unlock_irq(&dmapp_dev->spinlock);
+
+		if (!fence) {
+			return 0;
+		}
+
+		ret = dmapp_fence_wait(dmapp_dev, fence, timeout_ns, false);
+		dma_fence_put(fence);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+}
+
+/* Fences for the next turn of a user which are allocated up front so that
+ * the lock itself cannot fail
+ */
+struct dmapp_lock_fences {
+	struct dma_fence *next_fence;
+	struct dma_fence *tiles[DMAPP_TILES_MAX];
+};
+
+static int dmapp_lock_fences_alloc(struct dmapp_device *dmapp_dev,
+	struct dmapp_lock_fences *lock) {
+	int ret;
+
+	lock->next_fence = dmapp_fence_alloc();
+	if (!lock->next_fence) {
+		return -ENOMEM;
+	}
+
+	ret = dmapp_tiles_alloc(dmapp_dev, lock->tiles);
+	if (ret < 0) {
+		kfree(container_of(lock->next_fence, struct dmapp_fence, base));
+		lock->next_fence = NULL;
+		return ret;
+	}
+
+	return 0;
+}
+
+/* Free lock fences which were not consumed by a lock */
+static void dmapp_lock_fences_free(struct dmapp_device *dmapp_dev,
+	struct dmapp_lock_fences *lock) {
+	u32 i;
+
+	if (!lock->next_fence) {
+		return;
+	}
+
+	kfree(container_of(lock->next_fence, struct dmapp_fence, base));
+	for (i = 0; i < dmapp_dev->tiles; ++i) {
+		kfree(container_of(lock->tiles[i], struct dmapp_fence, base));
+	}
+	lock->next_fence = NULL;
+}
+
+/* Replace the wait fence (and its tiles) with the next fence on our
+ * timeline and set the locked flag. Returns false without consuming the
+ * lock fences when another thread locked the buffer for the user first.
+ */
+static bool dmapp_buffer_lock_commit(struct dmapp_user *user, int parity,
+	struct dmapp_lock_fences *lock) {
+	struct dmapp_device *dmapp_dev = user->dmapp_dev;
+	struct dma_fence *old_fence;
+
+	spin_lock_irq(&dmapp_dev->spinlock);
+	if (user->is_locked) {
+		spin_unlock_irq(&dmapp_dev->spinlock);
+		return false;
+	}
+	old_fence = dmapp_dev->fence[parity];
+	dmapp_fence_init_locked(dmapp_dev, parity, lock->next_fence);
+	dmapp_dev->fence[parity] = lock->next_fence;
+	dmapp_tiles_init_locked(dmapp_dev, parity, lock->next_fence, lock->tiles);
+	user->is_locked = true;
+	user->damage_since = user->damage_frame;
+	user->damage_frame = dmapp_dev->frame;
+	spin_unlock_irq(&dmapp_dev->spinlock);
+
+	/* The lock fences now hold the old tiles */
+	dma_fence_put(old_fence);
+	dmapp_tiles_put(dmapp_dev, lock->tiles);
+	lock->next_fence = NULL;
+
+	return true;
+}
+
+static int dmapp_buffer_lock(struct dmapp_user *user, int parity,
+	struct dma_fence *wait_fence, const struct dmapp_lock_args *args) {
+	struct dmapp_device *dmapp_dev = user->dmapp_dev;
+	struct dmapp_lock_fences lock;
+	struct dma_buf *buf;
+	bool committed;
+	int ret;
+
+	/* Wait for our turn to process the buffer where a zero timeout only
+	 * polls the turn (e.g. for the relay) and says nothing about the peer
+	 */
+	dmapp_fence_wait_deadline(wait_fence, args->deadline_ns);
+	ret = dmapp_fence_wait(dmapp_dev, wait_fence, args->timeout_ns,
+		args->timeout_ns != 0);
+	if (ret == -ETIMEDOUT) {
+		return ret;
+	} else if (ret < 0) {
+		/* Wait may fail if interrupted by a signal */
+		pr_err("dmapp_buffer_lock: dmapp_fence_wait failed (%i)\n", ret);
+		return ret;
+	}
+
+	/* Wait for the readers of the previous frame */
+	ret = dmapp_readers_wait(dmapp_dev, args->timeout_ns);
+	if (ret < 0) {
+		return ret;
+	}
+
+	ret = dmapp_lock_fences_alloc(dmapp_dev, &lock);
+	if (ret < 0) {
+		return ret;
+	}
+
+	/* Commit under the buffer reservation so that the lock cannot
+	 * interleave with a LOCK_MULTI which holds it
+	 */
+	buf = dmapp_buf_get(dmapp_dev);
+	ret = dma_resv_lock_interruptible(buf->resv, NULL);
+	if (ret < 0) {
+		dma_buf_put(buf);
+		dmapp_lock_fences_free(dmapp_dev, &lock);
+		return ret;
+	}
+	committed = dmapp_buffer_lock_commit(user, parity, &lock);
+	dma_resv_unlock(buf->resv);
+	dma_buf_put(buf);
+
+	if (!committed) {
+		dmapp_lock_fences_free(dmapp_dev, &lock);
+		return -EBUSY;
+	}
+
+	return 0;
+}
+
+static int dmapp_buffer_unlock(struct dmapp_user *user, int parity,
+	struct dma_fence *signal_fence) {
+	struct dmapp_device *dmapp_dev = user->dmapp_dev;
+	int ret;
+
+	/* Signal the next user that it may begin */
+	ret = dmapp_signal(dmapp_dev, 1 - parity, signal_fence);
+	if (ret < 0) {
+		/* Signal may fail if the fence was previously signaled */
+		pr_err("dmapp_buffer_unlock: dmapp_signal failed (%i)\n", ret);
+	}
+
+	/* Clear the locked flag */
+	spin_lock_irq(&dmapp_dev->spinlock);
+	user->is_locked = false;
+	spin_unlock_irq(&dmapp_dev->spinlock);
+
+	return ret;
+}
+
+static const struct file_operations dmapp_cdev_fops;
+
+/* Returns a reference to the fence that the user waits on for its next
+ * turn or NULL if the user is no longer valid
+ */
+static struct dma_fence *dmapp_user_get_wait_fence(struct dmapp_user *user,
+	int *parity) {
+	struct dmapp_device *dmapp_dev = user->dmapp_dev;
+	struct dma_fence *fence = NULL;
+
+	spin_lock_irq(&dmapp_dev->spinlock);
+	if (dmapp_dev->user[0] == user) {
+		*parity = 0;
+	} else if (dmapp_dev->user[1] == user) {
+		*parity = 1;
+	} else {
+		spin_unlock_irq(&dmapp_dev->spinlock);
+		return NULL;
+	}
+	fence = dma_fence_get(dmapp_dev->fence[*parity]);
+	spin_unlock_irq(&dmapp_dev->spinlock);
+
+	return fence;
+}
+
+/* Resolve an fd to a fence reference where dmapp devices resolve to the
+ * fence of the caller's next turn and any other fd must be a sync_file.
+ * The dmapp file reference is returned in file when requested.
+ */
+static struct dma_fence *dmapp_fd_get_fence(int fd, struct file **file,
+	int *parity) {
+	struct dma_fence *fence;
+	struct file *f;
+
+	f = fget(fd);
+	if (!f) {
+		return ERR_PTR(-EBADF);
+	}
+
+	if (f->f_op != &dmapp_cdev_fops) {
+		fput(f);
+		fence = sync_file_get_fence(fd);
+		return fence ? fence : ERR_PTR(-EINVAL);
+	}
+
+	fence = dmapp_user_get_wait_fence(f->private_data, parity);
+	if (!fence) {
+		fput(f);
+		return ERR_PTR(-EINVAL);
+	}
+
+	if (file) {
+		*file = f;
+	} else {
+		fput(f);
+	}
+
+	return fence;
+}
+
+static int dmapp_wait_multi(struct dmapp_device *dmapp_dev,
+	struct dmapp_wait_multi_args *args) {
+	struct file *files[DMAPP_WAIT_MULTI_MAX] = { NULL };
+	int parity[DMAPP_WAIT_MULTI_MAX];
+	struct dma_fence_array *array;
+	struct dma_fence **fences;
+	struct dmapp_lock_args lock_args = {
+		.timeout_ns = 0,
+	};
+	struct dmapp_user *user;
+	bool locked;
+	int ret = 0;
+	u32 i;
+
+	args->signaled = 0;
+	args->locked = 0;
+
+	if ((args->count == 0) || (args->count > DMAPP_WAIT_MULTI_MAX)) {
+		return -EINVAL;
+	}
+
+	/* Ownership of fences is transferred to the fence array */
+	fences = kcalloc(args->count, sizeof(*fences), GFP_KERNEL);
+	if (!fences) {
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < args->count; ++i) {
+		fences[i] = dmapp_fd_get_fence(args->fds[i], &files[i], &parity[i]);
+		if (IS_ERR(fences[i])) {
+			ret = PTR_ERR(fences[i]);
+			fences[i] = NULL;
+			goto err_fences;
+		}
+	}
+
+	array = dma_fence_array_create(args->count, fences,
+		dma_fence_context_alloc(1), 1, args->flags & DMAPP_WAIT_MULTI_ANY);
+	if (!array) {
+		ret = -ENOMEM;
+		goto err_fences;
+	}
+
+	ret = dmapp_fence_wait(dmapp_dev, &array->base, args->timeout_ns,
+		false);
+	if (ret < 0) {
+		goto out_wait;
+	}
+
+	/* Report and optionally lock the entries that are ready */
+	for (i = 0; i < args->count; ++i) {
+		if (!dma_fence_is_signaled(array->fences[i])) {
+			continue;
+		}
+		args->signaled |= 1U << i;
+
+		if (!files[i] || !(args->flags & DMAPP_WAIT_MULTI_LOCK)) {
+			continue;
+		}
+
+		user = files[i]->private_data;
+		spin_lock_irq(&user->dmapp_dev->spinlock);
+		locked = user->is_locked;
+		spin_unlock_irq(&user->dmapp_dev->spinlock);
+		if (locked) {
+			continue;
+		}
+
+		ret = dmapp_buffer_lock(user, parity[i], array->fences[i],
+			&lock_args);
+		if (ret < 0) {
+			break;
+		}
+		args->locked |= 1U << i;
+	}
+
+out_wait:
+	dma_fence_put(&array->base);
+	for (i = 0; i < args->count; ++i) {
+		if (files[i]) {
+			fput(files[i]);
+		}
+	}
+	return ret;
+
+err_fences:
+	for (i = 0; i < args->count; ++i) {
+		if (fences[i]) {
+			dma_fence_put(fences[i]);
+		}
+		if (files[i]) {
+			fput(files[i]);
+		}
+	}
+	kfree(fences);
+	return ret;
+}
+
+/* Acquire the reservations of the buffers (which requires the ww_mutex
+ * protocol when holding several) to publish their write fences. On
+ * -EDEADLK all locks are dropped and the contended lock is taken with the
+ * slow path before the remaining locks are retried.
+ */
+static int dmapp_resv_lock_all(struct dma_buf **bufs, u32 count,
+	struct ww_acquire_ctx *ctx) {
+	int contended = -1;
+	int ret;
+	int i;
+	int j;
+
+	ww_acquire_init(ctx, &reservation_ww_class);
+
+retry:
+	if (contended >= 0) {
+		ret = dma_resv_lock_slow_interruptible(bufs[contended]->resv, ctx);
+		if (ret < 0) {
+			ww_acquire_fini(ctx);
+			return ret;
+		}
+	}
+
+	for (i = 0; i < count; ++i) {
+		if (i == contended) {
+			continue;
+		}
+
+		ret = dma_resv_lock_interruptible(bufs[i]->resv, ctx);
+		if (ret < 0) {
+			for (j = 0; j < i; ++j) {
+				dma_resv_unlock(bufs[j]->resv);
+			}
+			if (contended > i) {
+				dma_resv_unlock(bufs[contended]->resv);
+			}
+
+			if (ret == -EDEADLK) {
+				contended = i;
+				goto retry;
+			}
+
+			ww_acquire_fini(ctx);
+			return ret;
+		}
+	}
+
+	ww_acquire_done(ctx);
+
+	return 0;
+}
+
+static void dmapp_resv_unlock_all(struct dma_buf **bufs, u32 count,
+	struct ww_acquire_ctx *ctx) {
+	u32 i;
+
+	for (i = 0; i < count; ++i) {
+		dma_resv_unlock(bufs[i]->resv);
+	}
+	ww_acquire_fini(ctx);
+}
+
+/* Check whether the turn of a LOCK_MULTI entry may be taken while the
+ * reservation of buf is held. Returns a reference to the turn or read fence
+ * which is still pending in wait (if any) and sets locked when the caller
+ * already holds the buffer. Returns -EAGAIN when buf was replaced.
+ */
+static int dmapp_lock_multi_check(struct dmapp_user *user,
+	struct dma_buf *buf, int *parity, bool *locked, struct dma_fence **wait) {
+	struct dmapp_device *dmapp_dev = user->dmapp_dev;
+	struct dma_fence *turn;
+	int ret = 0;
+
+	*wait = NULL;
+
+	spin_lock_irq(&dmapp_dev->spinlock);
+	if (dmapp_dev->user[0] == user) {
+		*parity = 0;
+	} else if (dmapp_dev->user[1] == user) {
+		*parity = 1;
+	} else {
+		ret = -EINVAL;
+	}
+	if ((ret == 0) && user->forward) {
+		ret = -EBUSY;
+	}
+	if ((ret == 0) && (dmapp_dev->buf != buf)) {
+		ret = -EAGAIN;
+	}
+	if (ret == 0) {
+		*locked = user->is_locked;
+	}
+	if ((ret == 0) && !*locked) {
+		turn = dmapp_dev->fence[*parity];
+		if (!dma_fence_is_signaled_locked(turn)) {
+			*wait = dma_fence_get(turn);
+		} else {
+			*wait = dmapp_readers_pending_locked(dmapp_dev);
+		}
+	}
+	spin_unlock_irq(&dmapp_dev->spinlock);
+
+	return ret;
+}
+
+static int dmapp_lock_multi(struct dmapp_lock_multi_args *args) {
+	struct file *files[DMAPP_LOCK_MULTI_MAX] = { NULL };
+	struct dmapp_user *users[DMAPP_LOCK_MULTI_MAX];
+	struct dma_buf *bufs[DMAPP_LOCK_MULTI_MAX] = { NULL };
+	int parity[DMAPP_LOCK_MULTI_MAX];
+	bool locked[DMAPP_LOCK_MULTI_MAX];
+	struct dmapp_lock_fences *locks;
+	struct dmapp_device *dmapp_dev;
+	struct dma_fence *signal_fence;
+	struct dma_fence *wait;
+	struct ww_acquire_ctx ctx;
+	ktime_t start = ktime_get();
+	s64 remaining_ns = -1;
+	bool turn;
+	int ret = 0;
+	u32 i;
+	u32 j;
+
+	if ((args->count == 0) || (args->count > DMAPP_LOCK_MULTI_MAX) ||
+		args->flags) {
+		return -EINVAL;
+	}
+
+	locks = kcalloc(args->count, sizeof(*locks), GFP_KERNEL);
+	if (!locks) {
+		return -ENOMEM;
+	}
+
+	/* Resolve the users and allocate their lock fences up front */
+	for (i = 0; i < args->count; ++i) {
+		files[i] = fget(args->fds[i]);
+		if (!files[i]) {
+			ret = -EBADF;
+			goto out;
+		}
+		if (files[i]->f_op != &dmapp_cdev_fops) {
+			ret = -EINVAL;
+			goto out;
+		}
+
+		users[i] = files[i]->private_data;
+		if (users[i]->is_reader) {
+			ret = -EPERM;
+			goto out;
+		}
+
+		dmapp_dev = users[i]->dmapp_dev;
+		for (j = 0; j < i; ++j) {
+			if (users[j]->dmapp_dev == dmapp_dev) {
+				ret = -EINVAL;
+				goto out;
+			}
+		}
+		bufs[i] = dmapp_buf_get(dmapp_dev);
+
+		ret = dmapp_lock_fences_alloc(dmapp_dev, &locks[i]);
+		if (ret < 0) {
+			goto out;
+		}
+	}
+
+	/* Acquire the reservations of all buffers with the ww_mutex protocol
+	 * and check every turn while holding them. A turn (or reader) which is
+	 * still pending backs off by dropping all reservations and waiting for
+	 * the fence before the acquire is retried so that a stage never holds
+	 * one buffer while it waits for another. Every turn is taken only once
+	 * all of them are ready and since each commit holds the reservation
+	 * the turns cannot be taken meanwhile, so either all buffers are locked
+	 * or none are.
+	 */
+retry:
+	ret = dmapp_resv_lock_all(bufs, args->count, &ctx);
+	if (ret < 0) {
+		goto out;
+	}
+
+	for (i = 0; i < args->count; ++i) {
+		ret = dma_resv_reserve_fences(bufs[i]->resv, 1);
+		if (ret < 0) {
+			goto out_resv;
+		}
+	}
+
+	wait = NULL;
+	for (i = 0; i < args->count; ++i) {
+		ret = dmapp_lock_multi_check(users[i], bufs[i], &parity[i],
+			&locked[i], &wait);
+		if ((ret < 0) || wait) {
+			break;
+		}
+	}
+
+	if ((ret < 0) || wait) {
+		dmapp_resv_unlock_all(bufs, args->count, &ctx);
+
+		/* Pick up a buffer which an import replaced */
+		if (ret == -EAGAIN) {
+			dma_buf_put(bufs[i]);
+			bufs[i] = dmapp_buf_get(users[i]->dmapp_dev);
+			goto retry;
+		} else if (ret < 0) {
+			goto out;
+		}
+
+		if (args->timeout_ns >= 0) {
+			remaining_ns = max_t(s64, 0, args->timeout_ns -
+				ktime_to_ns(ktime_sub(ktime_get(), start)));
+		}
+
+		dmapp_dev = users[i]->dmapp_dev;
+		turn = (wait->context == dmapp_dev->context + parity[i]);
+		ret = dmapp_fence_wait(dmapp_dev, wait, remaining_ns, turn);
+		dma_fence_put(wait);
+		if (ret < 0) {
+			goto out;
+		}
+		goto retry;
+	}
+
+	/* Lock every buffer and publish the fence that signals on unlock as the
+	 * write fence so that importers observe the lock with implicit sync.
+	 * Buffers which the caller already holds are left as they are.
+	 */
+	for (i = 0; i < args->count; ++i) {
+		if (locked[i]) {
+			continue;
+		}
+
+		/* Every commit holds the reservation so none fails here */
+		dmapp_dev = users[i]->dmapp_dev;
+		if (WARN_ON(!dmapp_buffer_lock_commit(users[i], parity[i],
+			&locks[i]))) {
+			continue;
+		}
+
+		spin_lock_irq(&dmapp_dev->spinlock);
+		signal_fence = dma_fence_get(dmapp_dev->fence[1 - parity[i]]);
+		spin_unlock_irq(&dmapp_dev->spinlock);
+
+		dma_resv_add_fence(bufs[i]->resv, signal_fence,
+			DMA_RESV_USAGE_WRITE);
+		dma_fence_put(signal_fence);
+	}
+
+out_resv:
+	dmapp_resv_unlock_all(bufs, args->count, &ctx);
+out:
+	for (i = 0; i < args->count; ++i) {
+		if (locks[i].next_fence) {
+			dmapp_lock_fences_free(users[i]->dmapp_dev, &locks[i]);
+		}
+		if (bufs[i]) {
+			dma_buf_put(bufs[i]);
+		}
+		if (files[i]) {
+			fput(files[i]);
+		}
+	}
+	kfree(locks);
+	return ret;
+}
+
+static void dmapp_job_free(struct dmapp_job *job) {
+	u32 i;
+
+	for (i = 0; i < job->args.num_deps; ++i) {
+		if (job->deps[i].fence) {
+			dma_fence_put(job->deps[i].fence);
+		}
+	}
+	if (job->unlock_fence) {
+		dma_fence_put(job->unlock_fence);
+	}
+	if (job->out_fence) {
+		dma_fence_put(job->out_fence);
+	}
+	if (job->src_buf) {
+		dma_buf_put(job->src_buf);
+	}
+	if (job->dst_buf) {
+		dma_buf_put(job->dst_buf);
+	}
+	kfree(job);
+}
+
+static int dmapp_job_execute(struct dmapp_job *job) {
+	struct dmapp_job_args *args = &job->args;
+	struct iosys_map dst_map;
+	struct iosys_map src_map;
+	int *dst;
+	int *src = NULL;
+	u32 sum = 0;
+	u32 i;
+	int ret;
+
+	/* Propagate dependency errors instead of executing */
+	for (i = 0; i < args->num_deps; ++i) {
+		if (job->deps[i].fence->error) {
+			return job->deps[i].fence->error;
+		}
+	}
+
+	ret = dma_buf_begin_cpu_access(job->dst_buf, DMA_BIDIRECTIONAL);
+	if (ret < 0) {
+		return ret;
+	}
+
+	if (job->src_buf && (job->src_buf != job->dst_buf)) {
+		ret = dma_buf_begin_cpu_access(job->src_buf, DMA_FROM_DEVICE);
+		if (ret < 0) {
+			goto err_begin_src;
+		}
+	}
+
+	/* Imported buffers are mapped by their exporter */
+	ret = dma_buf_vmap_unlocked(job->dst_buf, &dst_map);
+	if (ret < 0) {
+		goto err_vmap_dst;
+	}
+	/* I/O memory may not be accessed with plain loads and stores */
+	if (dst_map.is_iomem) {
+		ret = -EINVAL;
+		goto err_vmap_src;
+	}
+	dst = (int *) dst_map.vaddr + args->dst_offset;
+
+	if (job->src_buf) {
+		ret = dma_buf_vmap_unlocked(job->src_buf, &src_map);
+		if (ret < 0) {
+			goto err_vmap_src;
+		}
+		if (src_map.is_iomem) {
+			dma_buf_vunmap_unlocked(job->src_buf, &src_map);
+			ret = -EINVAL;
+			goto err_vmap_src;
+		}
+		src = (int *) src_map.vaddr + args->src_offset;
+	}
+
+	switch (args->op) {
+	case DMAPP_JOB_FILL:
+		for (i = 0; i < args->count; ++i) {
+			dst[i] = args->value;
+		}
+		break;
+	case DMAPP_JOB_COPY:
+		memmove(dst, src, args->count * sizeof(int));
+		break;
+	case DMAPP_JOB_INCREMENT:
+		for (i = 0; i < args->count; ++i) {
+			dst[i] += args->value;
+		}
+		break;
+	case DMAPP_JOB_CHECKSUM:
+		for (i = 0; i < args->count; ++i) {
+			sum += (u32) src[i];
+		}
+		dst[0] = (int) sum;
+		break;
+	}
+
+	if (job->src_buf) {
+		dma_buf_vunmap_unlocked(job->src_buf, &src_map);
+	}
+err_vmap_src:
+	dma_buf_vunmap_unlocked(job->dst_buf, &dst_map);
+err_vmap_dst:
+	if (job->src_buf && (job->src_buf != job->dst_buf)) {
+		dma_buf_end_cpu_access(job->src_buf, DMA_FROM_DEVICE);
+	}
+err_begin_src:
+	dma_buf_end_cpu_access(job->dst_buf, DMA_BIDIRECTIONAL);
+	return ret;
+}
+
+static void dmapp_job_complete(struct dmapp_job *job, int status) {
+	struct dmapp_engine *engine = &dmapp_engine;
+	struct dmapp_engine_stats *stats = &engine->stats[job->args.priority];
+	u64 latency_ns = ktime_to_ns(ktime_sub(ktime_get(), job->submit_time));
+	unsigned long flags;
+
+	if (status < 0) {
+		dma_fence_set_error(job->out_fence, status);
+	}
+	dma_fence_signal(job->out_fence);
+
+	/* Hand the buffer to the peer of the submitter */
+	if (job->unlock_fence) {
+		dmapp_fence_signal(job->dmapp_dev, job->unlock_parity,
+			job->unlock_fence);
+	}
+
+	spin_lock_irqsave(&engine->lock, flags);
+	if (status < 0) {
+		stats->failed++;
+	} else {
+		stats->completed++;
+	}
+	stats->total_latency_ns += latency_ns;
+	stats->max_latency_ns = max(stats->max_latency_ns, latency_ns);
+	spin_unlock_irqrestore(&engine->lock, flags);
+
+	dmapp_job_free(job);
+}
+
+/* Order in which the ready lists are dispatched (and reported) */
+static const u32 dmapp_job_priority_order[DMAPP_JOB_PRIORITY_COUNT] = {
+	DMAPP_JOB_PRIORITY_HIGH,
+	DMAPP_JOB_PRIORITY_NORMAL,
+	DMAPP_JOB_PRIORITY_LOW,
+};
+
+static void dmapp_engine_work(struct work_struct *work) {
+	struct dmapp_engine *engine = container_of(work, struct dmapp_engine, work);
+	struct dmapp_job *job;
+	unsigned long flags;
+	u32 prio;
+	int i;
+
+	while (1) {
+		/* Pick the oldest ready job of the highest priority */
+		job = NULL;
+		spin_lock_irqsave(&engine->lock, flags);
+		for (i = 0; i < DMAPP_JOB_PRIORITY_COUNT; ++i) {
+			prio = dmapp_job_priority_order[i];
+			job = list_first_entry_or_null(&engine->ready[prio],
+				struct dmapp_job, node);
+			if (job) {
+				list_del(&job->node);
+				engine->stats[prio].ready--;
+				engine->stats[prio].total_queue_ns +=
+					ktime_to_ns(ktime_sub(ktime_get(), job->ready_time));
+				break;
+			}
+		}
+		spin_unlock_irqrestore(&engine->lock, flags);
+
+		if (!job) {
+			break;
+		}
+
+		dmapp_job_complete(job, dmapp_job_execute(job));
+	}
+}
+
+/* Move a job to its ready queue once its last dependency signals. This
+ * may be called from the signaling context of any fence.
+ */
+static void dmapp_job_put_pending(struct dmapp_job *job) {
+	struct dmapp_engine *engine = &dmapp_engine;
+	struct dmapp_engine_stats *stats = &engine->stats[job->args.priority];
+	unsigned long flags;
+
+	if (!atomic_dec_and_test(&job->pending)) {
+		return;
+	}
+
+	spin_lock_irqsave(&engine->lock, flags);
+	job->ready_time = ktime_get();
+	list_move_tail(&job->node, &engine->ready[job->args.priority]);
+	stats->blocked--;
+	stats->ready++;
+	spin_unlock_irqrestore(&engine->lock, flags);
+
+	queue_work(engine->wq, &engine->work);
+}
+
+static void dmapp_job_dep_cb(struct dma_fence *fence, struct dma_fence_cb *cb) {
+	struct dmapp_job_dep *dep = container_of(cb, struct dmapp_job_dep, cb);
+	dmapp_job_put_pending(dep->job);
+}
+
+/* Validate a job and resolve its buffers */
+static int dmapp_job_init(struct dmapp_job *job, struct dmapp_device *dmapp_dev,
+	struct dmapp_job_args *args) {
+	struct dmapp_device *src_dev = dmapp_dev;
+	struct dmapp_user *src_user;
+	bool src_locked;
+	size_t dst_count;
+	size_t src_count = 0;
+	struct file *file;
+	bool need_src = (args->op == DMAPP_JOB_COPY) ||
+		(args->op == DMAPP_JOB_CHECKSUM);
+
+	int parity;
+	u32 i;
+
+	if ((args->op > DMAPP_JOB_CHECKSUM) ||
+		(args->priority >= DMAPP_JOB_PRIORITY_COUNT) ||
+		(args->num_deps > DMAPP_JOB_MAX_DEPS)) {
+		return -EINVAL;
+	}
+
+	/* Fence references are dropped by dmapp_job_free */
+	job->args.num_deps = args->num_deps;
+	for (i = 0; i < args->num_deps; ++i) {
+		job->deps[i].fence = dmapp_fd_get_fence(args->dep_fds[i], NULL,
+			&parity);
+		if (IS_ERR(job->deps[i].fence)) {
+			int ret = PTR_ERR(job->deps[i].fence);
+			job->deps[i].fence = NULL;
+			return ret;
+		}
+		job->deps[i].job = job;
+	}
+
+	/* An import may replace the buffer so the size is taken together with
+	 * the reference
+	 */
+	job->dmapp_dev = dmapp_dev;
+	job->dst_buf = dmapp_buf_get_size(dmapp_dev, &dst_count);
+
+	if (need_src) {
+		if (args->src_fd < 0) {
+			job->src_buf = job->dst_buf;
+			get_dma_buf(job->src_buf);
+			src_count = dst_count;
+		} else {
+			file = fget(args->src_fd);
+			if (!file) {
+				return -EBADF;
+			}
+			if (file->f_op != &dmapp_cdev_fops) {
+				fput(file);
+				return -EINVAL;
+			}
+			src_user = file->private_data;
+			src_dev = src_user->dmapp_dev;
+
+			/* The source may not change while the job reads it */
+			spin_lock_irq(&src_dev->spinlock);
+			src_locked = src_user->is_locked;
+			spin_unlock_irq(&src_dev->spinlock);
+			if (!src_locked) {
+				fput(file);
+				return -EPERM;
+			}
+
+			job->src_buf = dmapp_buf_get_size(src_dev, &src_count);
+			fput(file);
+		}
+	}
+
+	/* Resolve the count and check the ranges where the exported buffers are
+	 * page aligned so the sizes come from the devices
+	 */
+	if (args->count == 0) {
+		if (args->op == DMAPP_JOB_CHECKSUM) {
+			args->count = src_count - min_t(size_t, args->src_offset, src_count);
+		} else {
+			args->count = dst_count - min_t(size_t, args->dst_offset, dst_count);
+		}
+	}
+
+	if (args->op == DMAPP_JOB_CHECKSUM) {
+		if (args->dst_offset >= dst_count) {
+			return -EINVAL;
+		}
+	} else if ((args->dst_offset > dst_count) ||
+		(args->count > dst_count - args->dst_offset)) {
+		return -EINVAL;
+	}
+
+	if (need_src && ((args->src_offset > src_count) ||
+		(args->count > src_count - args->src_offset))) {
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int dmapp_job_submit(struct dmapp_user *user, int parity,
+	struct dma_fence *signal_fence, struct dmapp_job_args *args) {
+	struct dmapp_device *dmapp_dev = user->dmapp_dev;
+	struct dmapp_engine *engine = &dmapp_engine;
+	struct sync_file *sync_file;
+	struct dmapp_job *job;
+	unsigned long flags;
+	u32 i;
+	int fd;
+	int ret;
+
+	job = kzalloc(sizeof(*job), GFP_KERNEL);
+	if (!job) {
+		return -ENOMEM;
+	}
+
+	ret = dmapp_job_init(job, dmapp_dev, args);
+	if (ret < 0) {
+		goto err_job_init;
+	}
+	job->args = *args;
+
+	job->out_fence = dmapp_fence_alloc();
+	if (!job->out_fence) {
+		ret = -ENOMEM;
+		goto err_job_init;
+	}
+
+	/* Jobs may complete out of submission order so each out fence is given
+	 * its own context. The fence lock is separate from the engine lock since
+	 * signaling may run the callbacks of dependent jobs.
+	 */
+	dma_fence_init(job->out_fence, &dmapp_fence_ops, &engine->fence_lock,
+		dma_fence_context_alloc(1), 1);
+
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0) {
+		ret = fd;
+		goto err_job_init;
+	}
+
+	sync_file = sync_file_create(job->out_fence);
+	if (!sync_file) {
+		ret = -ENOMEM;
+		goto err_sync_file;
+	}
+
+	/* The dst buffer must belong to the submitter while the job runs and the
+	 * lock is optionally handed to the engine
+	 */
+	spin_lock_irq(&dmapp_dev->spinlock);
+	if (!user->is_locked) {
+		spin_unlock_irq(&dmapp_dev->spinlock);
+		ret = -EPERM;
+		goto err_locked;
+	}
+	if (args->flags & DMAPP_JOB_UNLOCK) {
+		user->is_locked = false;
+		job->unlock_fence = dma_fence_get(signal_fence);
+		job->unlock_parity = 1 - parity;
+	}
+	spin_unlock_irq(&dmapp_dev->spinlock);
+
+	args->fence_fd = fd;
+	fd_install(fd, sync_file->file);
+
+	job->submit_time = ktime_get();
+	spin_lock_irqsave(&engine->lock, flags);
+	list_add_tail(&job->node, &engine->blocked);
+	engine->stats[args->priority].submitted++;
+	engine->stats[args->priority].blocked++;
+	spin_unlock_irqrestore(&engine->lock, flags);
+
+	/* Hold a pending reference while the dependency callbacks are added so
+	 * that the job cannot become ready early
+	 */
+	atomic_set(&job->pending, args->num_deps + 1);
+	for (i = 0; i < args->num_deps; ++i) {
+		if (dma_fence_add_callback(job->deps[i].fence, &job->deps[i].cb,
+			dmapp_job_dep_cb)) {
+			/* The dependency already signaled */
+			dmapp_job_put_pending(job);
+		}
+	}
+	dmapp_job_put_pending(job);
+
+	return 0;
+
+err_locked:
+	fput(sync_file->file);
+err_sync_file:
+	put_unused_fd(fd);
+err_job_init:
+	dmapp_job_free(job);
+	return ret;
+}
+
+static int dmapp_engine_init(struct dmapp_engine *engine) {
+	int prio;
+
+	spin_lock_init(&engine->lock);
+	spin_lock_init(&engine->fence_lock);
+	INIT_LIST_HEAD(&engine->blocked);
+	for (prio = 0; prio < DMAPP_JOB_PRIORITY_COUNT; ++prio) {
+		INIT_LIST_HEAD(&engine->ready[prio]);
+	}
+	INIT_WORK(&engine->work, dmapp_engine_work);
+
+	engine->wq = alloc_ordered_workqueue("dmapp_engine", WQ_HIGHPRI);
+	if (!engine->wq) {
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/* Fail the jobs which are still blocked on their dependencies. A callback
+ * which cannot be removed has already run under the fence lock, so the job
+ * is either made ready by its last callback or cancelled here.
+ */
+static void dmapp_engine_cancel(struct dmapp_engine *engine) {
+	struct dmapp_job *job;
+	unsigned long flags;
+	int removed;
+	u32 i;
+
+	while (1) {
+		spin_lock_irqsave(&engine->lock, flags);
+		job = list_first_entry_or_null(&engine->blocked, struct dmapp_job,
+			node);
+		if (job) {
+			list_del_init(&job->node);
+		}
+		spin_unlock_irqrestore(&engine->lock, flags);
+
+		if (!job) {
+			break;
+		}
+
+		removed = 0;
+		for (i = 0; i < job->args.num_deps; ++i) {
+			if (dma_fence_remove_callback(job->deps[i].fence,
+				&job->deps[i].cb)) {
+				++removed;
+			}
+		}
+
+		if (removed && atomic_sub_and_test(removed, &job->pending)) {
+			spin_lock_irqsave(&engine->lock, flags);
+			engine->stats[job->args.priority].blocked--;
+			spin_unlock_irqrestore(&engine->lock, flags);
+
+			dmapp_job_complete(job, -ECANCELED);
+		}
+	}
+}
+
+static void dmapp_engine_destroy(struct dmapp_engine *engine) {
+	/* Cancel the blocked jobs so that no dependency callback queues work
+	 * later and drain the queue before the devices that jobs reference go
+	 * away
+	 */
+	dmapp_engine_cancel(engine);
+	destroy_workqueue(engine->wq);
+}
+
+static int dmapp_tile(struct dmapp_user *user, int parity, unsigned int cmd,
+	struct dmapp_tile_args *args) {
+	struct dmapp_device *dmapp_dev = user->dmapp_dev;
+	u32 size = dmapp_dev->size;
+	struct dma_fence *fence;
+	int ret = 0;
+
+	if (args->tile >= dmapp_dev->tiles) {
+		return -EINVAL;
+	}
+
+	args->tiles = dmapp_dev->tiles;
+	args->offset = args->tile * size / dmapp_dev->tiles;
+	args->count = (args->tile + 1) * size / dmapp_dev->tiles - args->offset;
+
+	spin_lock_irq(&dmapp_dev->spinlock);
+	if (cmd == DMAPP_IOCTL_TILE_UNLOCK) {
+		/* Only the lock holder may signal the tiles of the peer */
+		if (!user->is_locked) {
+			spin_unlock_irq(&dmapp_dev->spinlock);
+			return -EPERM;
+		}
+		fence = dma_fence_get(dmapp_dev->tile_fence[1 - parity][args->tile]);
+	} else {
+		fence = dma_fence_get(dmapp_dev->tile_fence[parity][args->tile]);
+	}
+	spin_unlock_irq(&dmapp_dev->spinlock);
+
+	if (cmd == DMAPP_IOCTL_TILE_UNLOCK) {
+		/* Unlocking a tile twice is harmless */
+		dma_fence_signal(fence);
+	} else {
+		ret = dmapp_fence_wait(dmapp_dev, fence, args->timeout_ns, false);
+	}
+	dma_fence_put(fence);
+
+	return ret;
+}
+
+static int dmapp_damage_cmp(const void *a, const void *b) {
+	const struct dmapp_damage_range *ra = a;
+	const struct dmapp_damage_range *rb = b;
+
+	if (ra->offset < rb->offset) {
+		return -1;
+	}
+	return ra->offset > rb->offset;
+}
+
+static int dmapp_damage_set(struct dmapp_user *user,
+	const struct dmapp_damage_args *args) {
+	struct dmapp_device *dmapp_dev = user->dmapp_dev;
+	u32 i;
+
+	if ((args->count > DMAPP_DAMAGE_MAX) ||
+		(args->flags & ~DMAPP_DAMAGE_ALL)) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < args->count; ++i) {
+		if ((args->ranges[i].offset > dmapp_dev->size) ||
+			(args->ranges[i].count >
+			 dmapp_dev->size - args->ranges[i].offset)) {
+			return -EINVAL;
+		}
+	}
+
+	/* The damage belongs to the frame published when the pass ends */
+	spin_lock_irq(&dmapp_dev->spinlock);
+	if (!user->is_locked) {
+		spin_unlock_irq(&dmapp_dev->spinlock);
+		return -EPERM;
+	}
+	dmapp_dev->damage[(dmapp_dev->frame + 1) % DMAPP_DAMAGE_HISTORY] = *args;
+	spin_unlock_irq(&dmapp_dev->spinlock);
+
+	return 0;
+}
+
+static int dmapp_damage_get(struct dmapp_user *user,
+	struct dmapp_damage_args *args) {
+	struct dmapp_device *dmapp_dev = user->dmapp_dev;
+	struct dmapp_damage_range *ranges;
+	struct dmapp_damage_args *damage;
+	u32 count = 0;
+	u32 gap;
+	u32 end;
+	u32 best;
+	u32 i;
+	u64 f;
+
+	memset(args, 0, sizeof(*args));
+
+	ranges = kmalloc_array(DMAPP_DAMAGE_HISTORY * DMAPP_DAMAGE_MAX,
+		sizeof(*ranges), GFP_KERNEL);
+	if (!ranges) {
+		return -ENOMEM;
+	}
+
+	/* Gather the damage of the frames since the previous lock where the
+	 * history slot after the current frame belongs to the pass in progress
+	 */
+	spin_lock_irq(&dmapp_dev->spinlock);
+	if ((user->damage_since == 0) ||
+		(dmapp_dev->frame - user->damage_since > DMAPP_DAMAGE_HISTORY - 1)) {
+		args->flags = DMAPP_DAMAGE_ALL;
+	}
+	for (f = user->damage_since + 1; !args->flags &&
+		(f <= user->damage_frame); ++f) {
+		damage = &dmapp_dev->damage[f % DMAPP_DAMAGE_HISTORY];
+		if (damage->flags & DMAPP_DAMAGE_ALL) {
+			args->flags = DMAPP_DAMAGE_ALL;
+			break;
+		}
+		memcpy(&ranges[count], damage->ranges,
+			damage->count * sizeof(*ranges));
+		count += damage->count;
+	}
+	spin_unlock_irq(&dmapp_dev->spinlock);
+
+	if (args->flags) {
+		goto out;
+	}
+
+	/* Merge overlapping and adjacent ranges */
+	sort(ranges, count, sizeof(*ranges), dmapp_damage_cmp, NULL);
+	for (i = 0; i < count; ++i) {
+		if (ranges[i].count == 0) {
+			continue;
+		}
+
+		if (args->count) {
+			struct dmapp_damage_range *last = &ranges[args->count - 1];
+
+			end = last->offset + last->count;
+			if (ranges[i].offset <= end) {
+				last->count = max(end, ranges[i].offset + ranges[i].count) -
+					last->offset;
+				continue;
+			}
+		}
+		ranges[args->count++] = ranges[i];
+	}
+
+	/* Coalesce the ranges separated by the smallest gaps */
+	while (args->count > DMAPP_DAMAGE_MAX) {
+		best = 0;
+		gap = U32_MAX;
+		for (i = 0; i + 1 < args->count; ++i) {
+			end = ranges[i].offset + ranges[i].count;
+			if (ranges[i + 1].offset - end < gap) {
+				gap = ranges[i + 1].offset - end;
+				best = i;
+			}
+		}
+
+		ranges[best].count = ranges[best + 1].offset +
+			ranges[best + 1].count - ranges[best].offset;
+		memmove(&ranges[best + 1], &ranges[best + 2],
+			(args->count - best - 2) * sizeof(*ranges));
+		args->count--;
+	}
+
+	memcpy(args->ranges, ranges, args->count * sizeof(*ranges));
+
+out:
+	kfree(ranges);
+	return 0;
+}
+
+static bool dmapp_reader_ready(struct dmapp_user *user) {
+	return READ_ONCE(user->armed_frame) > user->frame;
+}
+
+static int dmapp_read_lock(struct dmapp_user *user,
+	struct dmapp_read_args *args) {
+	struct dmapp_device *dmapp_dev = user->dmapp_dev;
+	long ret;
+
+	/* Wait for a frame which was armed for this reader */
+	if (user->is_locked) {
+		/* Nothing to do */
+	} else if (args->timeout_ns < 0) {
+		ret = wait_event_interruptible(dmapp_dev->frame_wq,
+			dmapp_reader_ready(user));
+		if (ret < 0) {
+			return ret;
+		}
+	} else {
+		ret = wait_event_interruptible_timeout(dmapp_dev->frame_wq,
+			dmapp_reader_ready(user), nsecs_to_jiffies(args->timeout_ns));
+		if (ret < 0) {
+			return ret;
+		} else if (ret == 0) {
+			return -ETIMEDOUT;
+		}
+	}
+
+	spin_lock_irq(&dmapp_dev->spinlock);
+	user->damage_since = user->damage_frame;
+	user->frame = user->armed_frame;
+	user->damage_frame = user->frame;
+	user->is_locked = true;
+	args->frame = user->frame;
+	spin_unlock_irq(&dmapp_dev->spinlock);
+
+	return 0;
+}
+
+static int dmapp_read_unlock(struct dmapp_user *user) {
+	struct dmapp_device *dmapp_dev = user->dmapp_dev;
+	struct dma_fence *spare = NULL;
+	struct dma_fence *fence;
+
+	/* Allocate the fence for the next frame before releasing this one */
+	if (!user->read_spare) {
+		spare = dmapp_fence_alloc();
+		if (!spare) {
+			return -ENOMEM;
+		}
+	}
+
+	spin_lock_irq(&dmapp_dev->spinlock);
+	if (!user->is_locked) {
+		/* Ignore ioctl when already in unlocked state */
+		spin_unlock_irq(&dmapp_dev->spinlock);
+		if (spare) {
+			kfree(container_of(spare, struct dmapp_fence, base));
+		}
+		return 0;
+	}
+	if (spare) {
+		user->read_spare = spare;
+	}
+	fence = dma_fence_get(user->read_fence);
+	user->is_locked = false;
+	spin_unlock_irq(&dmapp_dev->spinlock);
+
+	dma_fence_signal(fence);
+	dma_fence_put(fence);
+
+	return 0;
+}
+
+static long dmapp_reader_ioctl(struct dmapp_user *user, unsigned int cmd,
+	unsigned long arg) {
+	struct dmapp_device *dmapp_dev = user->dmapp_dev;
+	struct dmapp_read_args read_args;
+	struct dmapp_damage_args damage_args;
+	struct dmapp_node_args node_args = {
+		.node = NUMA_NO_NODE,
+	};
+	struct dmapp_layout_args layout_args;
+	struct dma_buf *buf;
+	int ret;
+
+	switch (cmd) {
+	case DMAPP_IOCTL_GET_BUFFER_SIZE:
+		return dmapp_dev->size;
+	case DMAPP_IOCTL_GET_BUFFER_FD:
+		buf = dmapp_buf_get(dmapp_dev);
+		ret = dma_buf_fd(buf, 0);
+		if (ret < 0) {
+			dma_buf_put(buf);
+		}
+		return ret;
+	case DMAPP_IOCTL_READ_LOCK:
+		pr_info("DMAPP_IOCTL_READ_LOCK\n");
+		if (copy_from_user(&read_args, (struct dmapp_read_args __user *) arg,
+			sizeof(read_args))) {
+			return -EFAULT;
+		}
+
+		ret = dmapp_read_lock(user, &read_args);
+		if ((ret == 0) && put_user(read_args.frame,
+			&((struct dmapp_read_args __user *) arg)->frame)) {
+			ret = -EFAULT;
+		}
+		return ret;
+	case DMAPP_IOCTL_READ_UNLOCK:
+		pr_info("DMAPP_IOCTL_READ_UNLOCK\n");
+		return dmapp_read_unlock(user);
+	case DMAPP_IOCTL_GET_NODE:
+		dmapp_buf_node(dmapp_dev, &node_args);
+		if (copy_to_user((struct dmapp_node_args __user *) arg, &node_args,
+			sizeof(node_args))) {
+			return -EFAULT;
+		}
+		return 0;
+	case DMAPP_IOCTL_GET_LAYOUT:
+		dmapp_get_layout(dmapp_dev, &layout_args);
+		if (copy_to_user((struct dmapp_layout_args __user *) arg,
+			&layout_args, sizeof(layout_args))) {
+			return -EFAULT;
+		}
+		return 0;
+	case DMAPP_IOCTL_GET_DAMAGE:
+		pr_info("DMAPP_IOCTL_GET_DAMAGE\n");
+		ret = dmapp_damage_get(user, &damage_args);
+		if ((ret == 0) && copy_to_user((struct dmapp_damage_args __user *) arg,
+			&damage_args, sizeof(damage_args))) {
+			ret = -EFAULT;
+		}
+		return ret;
+	}
+
+	/* Readers may not take part in the lock protocol */
+	return -EPERM;
+}
+
+/* Map the ring header of the current buffer. The reference keeps the
+ * mapping valid even if an import replaces the buffer.
+ */
+static struct dma_buf *dmapp_ring_map(struct dmapp_device *dmapp_dev,
+	struct iosys_map *map) {
+	struct dma_buf *buf;
+	int ret;
+
+	buf = dmapp_buf_get(dmapp_dev);
+	ret = dma_buf_vmap_unlocked(buf, map);
+	if (ret < 0) {
+		dma_buf_put(buf);
+		return ERR_PTR(ret);
+	}
+
+	if (map->is_iomem) {
+		dma_buf_vunmap_unlocked(buf, map);
+		dma_buf_put(buf);
+		return ERR_PTR(-EINVAL);
+	}
+
+	return buf;
+}
+
+static void dmapp_ring_unmap(struct dma_buf *buf, struct iosys_map *map) {
+	dma_buf_vunmap_unlocked(buf, map);
+	dma_buf_put(buf);
+}
+
+static int dmapp_ring_init(struct dmapp_user *user) {
+	struct dmapp_device *dmapp_dev = user->dmapp_dev;
+	struct dmapp_ring *ring;
+	struct iosys_map map;
+	struct dma_buf *buf;
+	bool locked;
+	int ret;
+
+	/* The buffer cannot be replaced while the caller holds it */
+	spin_lock_irq(&dmapp_dev->spinlock);
+	locked = user->is_locked;
+	spin_unlock_irq(&dmapp_dev->spinlock);
+	if (!locked) {
+		return -EPERM;
+	}
+
+	buf = dmapp_ring_map(dmapp_dev, &map);
+	if (IS_ERR(buf)) {
+		return PTR_ERR(buf);
+	}
+	ring = map.vaddr;
+
+	/* The header page must be followed by at least one data page */
+	if (buf->size <= PAGE_SIZE) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	memset(ring, 0, sizeof(*ring));
+	ring->size = rounddown_pow_of_two(buf->size - PAGE_SIZE);
+	ret = ring->size;
+
+out:
+	dmapp_ring_unmap(buf, &map);
+	return ret;
+}
+
+/* The header lives in shared memory so a ring which was never initialized
+ * (or whose size was overwritten) must not be trusted.
+ */
+static bool dmapp_ring_valid(struct dma_buf *buf, struct dmapp_ring *ring) {
+	u32 size = READ_ONCE(ring->size);
+
+	return (buf->size > PAGE_SIZE) && is_power_of_2(size) &&
+		(size <= buf->size - PAGE_SIZE);
+}
+
+static int dmapp_ring_wait(struct dmapp_device *dmapp_dev,
+	const struct dmapp_ring_wait_args *args) {
+	struct dmapp_ring *ring;
+	struct iosys_map map;
+	struct dma_buf *buf;
+	u32 *index;
+	u32 used;
+	long ret;
+
+	if ((args->index != DMAPP_RING_HEAD) &&
+		(args->index != DMAPP_RING_TAIL)) {
+		return -EINVAL;
+	}
+
+	buf = dmapp_ring_map(dmapp_dev, &map);
+	if (IS_ERR(buf)) {
+		return PTR_ERR(buf);
+	}
+	ring = map.vaddr;
+
+	if (!dmapp_ring_valid(buf, ring)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* The waiter owns the other index so value must lie within a ring of
+	 * it (e.g. the consumer waits on the head which it last saw)
+	 */
+	if (args->index == DMAPP_RING_HEAD) {
+		index = &ring->head;
+		used = args->value - READ_ONCE(ring->tail);
+	} else {
+		index = &ring->tail;
+		used = READ_ONCE(ring->head) - args->value;
+	}
+
+	if (used > READ_ONCE(ring->size)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* Sleep until the peer moves the index like a futex wait */
+	if (args->timeout_ns < 0) {
+		ret = wait_event_interruptible(dmapp_dev->ring_wq,
+			READ_ONCE(*index) != args->value);
+	} else {
+		ret = wait_event_interruptible_timeout(dmapp_dev->ring_wq,
+			READ_ONCE(*index) != args->value,
+			nsecs_to_jiffies(args->timeout_ns));
+		if (ret >= 0) {
+			ret = ret ? 0 : -ETIMEDOUT;
+		}
+	}
+
+out:
+	dmapp_ring_unmap(buf, &map);
+	return ret;
+}
+
+static int dmapp_ring_wake(struct dmapp_device *dmapp_dev) {
+	struct iosys_map map;
+	struct dma_buf *buf;
 	int ret = 0;
-	struct dmapp_user *user = (struct dmapp_user *) file->private_data;
+
+	buf = dmapp_ring_map(dmapp_dev, &map);
+	if (IS_ERR(buf)) {
+		return PTR_ERR(buf);
+	}
+
+	if (dmapp_ring_valid(buf, map.vaddr)) {
+		wake_up_interruptible_all(&dmapp_dev->ring_wq);
+	} else {
+		ret = -EINVAL;
+	}
+
+	dmapp_ring_unmap(buf, &map);
+	return ret;
+}
+
+static void dmapp_forward_cb(struct dma_fence *fence,
+	struct dma_fence_cb *cb) {
+	struct dmapp_forward *forward = container_of(cb, struct dmapp_forward, cb);
+
+	/* Defer to the engine since the fence lock is held */
+	queue_work(dmapp_engine.wq, &forward->work);
+}
+
+/* Take a reference to the turn fence of the relay while it is pending or
+ * else to the read fence of a reader which still holds the last frame.
+ * Returns false when neither is pending. The forward lock must be held.
+ */
+static bool dmapp_forward_pending(struct dmapp_forward *forward) {
+	struct dmapp_device *dmapp_dev = forward->user->dmapp_dev;
+	struct dma_fence *turn;
+	struct dmapp_user *reader;
+
+	if (forward->fence) {
+		dma_fence_put(forward->fence);
+		forward->fence = NULL;
+	}
+
+	spin_lock_irq(&dmapp_dev->spinlock);
+	turn = dmapp_dev->fence[forward->parity];
+	if (!dma_fence_is_signaled_locked(turn)) {
+		forward->fence = dma_fence_get(turn);
+	} else {
+		list_for_each_entry(reader, &dmapp_dev->readers, node) {
+			if (reader->read_fence &&
+				!dma_fence_is_signaled_locked(reader->read_fence)) {
+				forward->fence = dma_fence_get(reader->read_fence);
+				break;
+			}
+		}
+	}
+	spin_unlock_irq(&dmapp_dev->spinlock);
+
+	return forward->fence != NULL;
+}
+
+/* Add the callback to the pending fence (if any). Returns false when
+ * nothing is pending and the relay may lock the buffer.
+ */
+static bool dmapp_forward_wait(struct dmapp_forward *forward) {
+	while (dmapp_forward_pending(forward)) {
+		if (dma_fence_add_callback(forward->fence, &forward->cb,
+			dmapp_forward_cb) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Wait for the next turn of the relay. The forward lock must be held. */
+static void dmapp_forward_arm(struct dmapp_forward *forward) {
+	if (!dmapp_forward_wait(forward)) {
+		/* Our turn has already arrived */
+		queue_work(dmapp_engine.wq, &forward->work);
+	}
+}
+
+static void dmapp_forward_work(struct work_struct *work) {
+	struct dmapp_forward *forward = container_of(work, struct dmapp_forward,
+		work);
+	struct dmapp_user *user = forward->user;
 	struct dmapp_device *dmapp_dev = user->dmapp_dev;
-	struct dma_fence *signal_fence = NULL;
+	struct dma_fence *wait_fence;
+	struct dma_fence *signal_fence;
+	struct dmapp_lock_args lock_args = {
+		.timeout_ns = 0,
+	};
+	int ret;
+
+	mutex_lock(&forward->lock);
+
+	if (forward->stop) {
+		goto out;
+	}
+
+	/* The fence which fired may have been a reader of several */
+	if (dmapp_forward_wait(forward)) {
+		goto out;
+	}
+
+	/* Neither the turn nor the readers are pending so the lock does not
+	 * block and a reader which slipped in meanwhile is simply rearmed
+	 */
+	spin_lock_irq(&dmapp_dev->spinlock);
+	wait_fence = dma_fence_get(dmapp_dev->fence[forward->parity]);
+	spin_unlock_irq(&dmapp_dev->spinlock);
+
+	ret = dmapp_buffer_lock(user, forward->parity, wait_fence, &lock_args);
+	dma_fence_put(wait_fence);
+	if (ret == -ETIMEDOUT) {
+		dmapp_forward_arm(forward);
+		goto out;
+	} else if (ret < 0) {
+		pr_err("dmapp_forward_work: dmapp_buffer_lock failed (%i)\n", ret);
+		forward->stop = true;
+		goto out;
+	}
+
+	if (forward->job) {
+		ret = dmapp_job_execute(forward->job);
+		if (ret < 0) {
+			pr_err("dmapp_forward_work: dmapp_job_execute failed (%i)\n",
+				ret);
+		}
+	}
+
+	spin_lock_irq(&dmapp_dev->spinlock);
+	signal_fence = dma_fence_get(dmapp_dev->fence[1 - forward->parity]);
+	spin_unlock_irq(&dmapp_dev->spinlock);
+
+	dmapp_buffer_unlock(user, forward->parity, signal_fence);
+	dma_fence_put(signal_fence);
+
+	forward->count++;
+	dmapp_forward_arm(forward);
+
+out:
+	mutex_unlock(&forward->lock);
+}
+
+/* Disarm and free a forward which has been detached from its user */
+static void dmapp_forward_stop(struct dmapp_forward *forward) {
+	mutex_lock(&forward->lock);
+	forward->stop = true;
+	if (forward->fence) {
+		dma_fence_remove_callback(forward->fence, &forward->cb);
+	}
+	mutex_unlock(&forward->lock);
+
+	/* A callback which already fired has queued the work */
+	cancel_work_sync(&forward->work);
+
+	pr_info("dmapp_forward_stop: forwarded %llu\n", forward->count);
+
+	if (forward->job) {
+		dmapp_job_free(forward->job);
+	}
+	if (forward->fence) {
+		dma_fence_put(forward->fence);
+	}
+	kfree(forward);
+}
+
+static int dmapp_forward(struct dmapp_user *user, int parity,
+	const struct dmapp_forward_args *args) {
+	struct dmapp_device *dmapp_dev = user->dmapp_dev;
+	struct dmapp_forward *forward;
+	struct dmapp_job_args job_args = {
+		.src_fd = -1,
+		.priority = DMAPP_JOB_PRIORITY_NORMAL,
+	};
+	int ret;
+
+	if (args->flags & DMAPP_FORWARD_STOP) {
+		spin_lock_irq(&dmapp_dev->spinlock);
+		forward = user->forward;
+		user->forward = NULL;
+		spin_unlock_irq(&dmapp_dev->spinlock);
+
+		if (forward) {
+			dmapp_forward_stop(forward);
+		}
+		return 0;
+	}
+
+	forward = kzalloc(sizeof(*forward), GFP_KERNEL);
+	if (!forward) {
+		return -ENOMEM;
+	}
+
+	INIT_WORK(&forward->work, dmapp_forward_work);
+	mutex_init(&forward->lock);
+	forward->user = user;
+	forward->parity = parity;
+
+	if (args->flags & DMAPP_FORWARD_OP) {
+		forward->job = kzalloc(sizeof(*forward->job), GFP_KERNEL);
+		if (!forward->job) {
+			ret = -ENOMEM;
+			goto err_forward;
+		}
+
+		job_args.op = args->op;
+		job_args.src_offset = args->offset;
+		job_args.dst_offset = args->offset;
+		job_args.count = args->count;
+		job_args.value = args->value;
+		ret = dmapp_job_init(forward->job, dmapp_dev, &job_args);
+		if (ret < 0) {
+			goto err_forward;
+		}
+		forward->job->args = job_args;
+	}
+
+	/* The relay takes over the lock protocol of the user */
+	spin_lock_irq(&dmapp_dev->spinlock);
+	if (user->forward || user->is_locked) {
+		spin_unlock_irq(&dmapp_dev->spinlock);
+		ret = -EBUSY;
+		goto err_forward;
+	}
+	user->forward = forward;
+	spin_unlock_irq(&dmapp_dev->spinlock);
+
+	mutex_lock(&forward->lock);
+	dmapp_forward_arm(forward);
+	mutex_unlock(&forward->lock);
+
+	return 0;
+
+err_forward:
+	if (forward->job) {
+		dmapp_job_free(forward->job);
+	}
+	kfree(forward);
+	return ret;
+}
+
+static void dmapp_import_release(struct dma_buf *buf,
+	struct dma_buf_attachment *attach, struct sg_table *sgt,
+	struct iosys_map *map) {
+	if (map) {
+		dma_buf_vunmap_unlocked(buf, map);
+	}
+	if (sgt) {
+		dma_buf_unmap_attachment_unlocked(attach, sgt, DMA_BIDIRECTIONAL);
+	}
+	if (attach) {
+		dma_buf_detach(buf, attach);
+	}
+	dma_buf_put(buf);
+}
+
+static bool dmapp_is_idle(struct dmapp_device *dmapp_dev) {
+	struct dmapp_user *reader;
+	int i;
+
+	for (i = 0; i < 2; ++i) {
+		if (dmapp_dev->user[i] && (dmapp_dev->user[i]->is_locked ||
+			dmapp_dev->user[i]->forward)) {
+			return false;
+		}
+	}
+
+	list_for_each_entry(reader, &dmapp_dev->readers, node) {
+		if (reader->is_locked) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Make buf (of size ints with an optional image layout) the buffer of
+ * the device which consumes the buf reference
+ */
+static int dmapp_import_buf(struct dmapp_device *dmapp_dev,
+	struct dma_buf *buf, u32 size, const struct dmapp_layout_args *layout) {
+	struct dma_buf_attachment *attach = NULL;
+	struct sg_table *sgt = NULL;
+	struct dma_buf_attachment *old_attach;
+	struct sg_table *old_sgt;
+	struct iosys_map old_map;
+	struct dma_buf *old_buf;
+	struct iosys_map map;
+	int ret;
+	int i;
+
+	if (buf != dmapp_dev->own_buf) {
+		if ((size == 0) || (size > DMAPP_BUFFER_SIZE_MAX) ||
+			(size > buf->size / sizeof(int))) {
+			ret = -EINVAL;
+			goto err_import;
+		}
+
+		/* Attach so that the exporter places the pages where the dmapp
+		 * device is able to reach them
+		 */
+		attach = dma_buf_attach(buf, dmapp_dev->device);
+		if (IS_ERR(attach)) {
+			ret = PTR_ERR(attach);
+			attach = NULL;
+			goto err_import;
+		}
+
+		sgt = dma_buf_map_attachment_unlocked(attach, DMA_BIDIRECTIONAL);
+		if (IS_ERR(sgt)) {
+			ret = PTR_ERR(sgt);
+			sgt = NULL;
+			goto err_import;
+		}
+	}
+
+	/* Keep the current buffer mapped so that the ring and the engine map it
+	 * cheaply
+	 */
+	ret = dma_buf_vmap_unlocked(buf, &map);
+	if (ret < 0) {
+		pr_err("dmapp_import: dma_buf_vmap failed with %i\n", ret);
+		goto err_import;
+	}
+
+	/* The ring, the engine and the CPU access the buffer with plain loads
+	 * and stores which I/O memory does not allow
+	 */
+	if (map.is_iomem) {
+		dma_buf_vunmap_unlocked(buf, &map);
+		ret = -EINVAL;
+		goto err_import;
+	}
+
+	/* Suballocations describe the current buffer */
+	mutex_lock(&dmapp_dev->sub_lock);
+	spin_lock_irq(&dmapp_dev->spinlock);
+	if (!dmapp_is_idle(dmapp_dev) || dmapp_dev->sub_count) {
+		spin_unlock_irq(&dmapp_dev->spinlock);
+		mutex_unlock(&dmapp_dev->sub_lock);
+		dmapp_import_release(buf, attach, sgt, &map);
+		return -EBUSY;
+	}
+
+	old_buf = dmapp_dev->buf;
+	old_attach = dmapp_dev->import_attach;
+	old_sgt = dmapp_dev->import_sgt;
+	old_map = dmapp_dev->map;
+
+	dmapp_dev->buf = buf;
+	dmapp_dev->import_attach = attach;
+	dmapp_dev->import_sgt = sgt;
+	dmapp_dev->map = map;
+	dmapp_dev->size = size;
+	if (layout) {
+		dmapp_dev->layout = *layout;
+	} else {
+		memset(&dmapp_dev->layout, 0, sizeof(dmapp_dev->layout));
+	}
+
+	/* The whole buffer changed for every user */
+	for (i = 0; i < DMAPP_DAMAGE_HISTORY; ++i) {
+		dmapp_dev->damage[i].count = 0;
+		dmapp_dev->damage[i].flags = DMAPP_DAMAGE_ALL;
+	}
+	spin_unlock_irq(&dmapp_dev->spinlock);
+
+	if (dmapp_dev->sub_pool) {
+		gen_pool_destroy(dmapp_dev->sub_pool);
+		dmapp_dev->sub_pool = NULL;
+	}
+	mutex_unlock(&dmapp_dev->sub_lock);
+
+	/* Jobs in flight hold their own references to the previous buffer */
+	dmapp_import_release(old_buf, old_attach, old_sgt, &old_map);
+
+	return dmapp_dev->size;
+
+err_import:
+	dmapp_import_release(buf, attach, sgt, NULL);
+	return ret;
+}
+
+static int dmapp_import(struct dmapp_device *dmapp_dev,
+	const struct dmapp_import_args *args) {
+	struct dma_buf *buf;
+
+	if (args->flags) {
+		return -EINVAL;
+	}
+
+	if (args->fd < 0) {
+		buf = dmapp_dev->own_buf;
+		get_dma_buf(buf);
+		return dmapp_import_buf(dmapp_dev, buf, dmapp_buffer_size, NULL);
+	}
+
+	buf = dma_buf_get(args->fd);
+	if (IS_ERR(buf)) {
+		return PTR_ERR(buf);
+	}
+
+	return dmapp_import_buf(dmapp_dev, buf, buf->size / sizeof(int),
+		NULL);
+}
+
+static struct sg_table *dmapp_pages_map(struct dma_buf_attachment *attachment,
+	enum dma_data_direction dir) {
+	struct dmapp_pages *pages = attachment->dmabuf->priv;
+	struct sg_table *sgt;
+	int ret;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt) {
+		return ERR_PTR(-ENOMEM);
+	}
+
+	ret = sg_alloc_table_from_pages(sgt, pages->pages, pages->npages, 0,
+		pages->npages << PAGE_SHIFT, GFP_KERNEL);
+	if (ret < 0) {
+		goto err_sg_alloc_table;
+	}
+
+	ret = dma_map_sgtable(attachment->dev, sgt, dir, 0);
+	if (ret < 0) {
+		goto err_dma_map_sgtable;
+	}
+
+	return sgt;
+
+err_dma_map_sgtable:
+	sg_free_table(sgt);
+err_sg_alloc_table:
+	kfree(sgt);
+	return ERR_PTR(ret);
+}
+
+static void dmapp_pages_unmap(struct dma_buf_attachment *attachment,
+	struct sg_table *sgt, enum dma_data_direction dir) {
+	dma_unmap_sgtable(attachment->dev, sgt, dir, 0);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static vm_fault_t dmapp_pages_fault(struct vm_fault *vmf) {
+	struct vm_area_struct *vma = vmf->vma;
+	struct dmapp_pages *pages = vma->vm_private_data;
+
+	if (vmf->pgoff >= pages->npages) {
+		return VM_FAULT_SIGBUS;
+	}
+
+	return vmf_insert_pfn(vma, vmf->address,
+		page_to_pfn(pages->pages[vmf->pgoff]));
+}
+
+static const struct vm_operations_struct dmapp_pages_vm_ops = {
+	.fault = dmapp_pages_fault,
+};
+
+/* Pinned user pages are usually anonymous which vm_insert_page rejects so
+ * the pages are inserted by pfn on demand
+ */
+static int dmapp_pages_mmap(struct dma_buf *dmabuf,
+	struct vm_area_struct *vma) {
+	/* Private mappings would need copy-on-write of the pfn entries */
+	if (!(vma->vm_flags & VM_SHARED)) {
+		return -EINVAL;
+	}
+
+	dmapp_vm_flags_set(vma, VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP);
+	vma->vm_ops = &dmapp_pages_vm_ops;
+	vma->vm_private_data = dmabuf->priv;
+	return 0;
+}
+
+static int dmapp_pages_vmap(struct dma_buf *dmabuf, struct iosys_map *map) {
+	struct dmapp_pages *pages = dmabuf->priv;
+	void *vaddr;
+
+	vaddr = vmap(pages->pages, pages->npages, VM_MAP, PAGE_KERNEL);
+	if (!vaddr) {
+		return -ENOMEM;
+	}
+
+	iosys_map_set_vaddr(map, vaddr);
+	return 0;
+}
+
+static void dmapp_pages_vunmap(struct dma_buf *dmabuf,
+	struct iosys_map *map) {
+	vunmap(map->vaddr);
+}
+
+static void dmapp_pages_put(struct dmapp_pages *pages, unsigned long count) {
+	unsigned long i;
 
-	spin_lock(&dmapp_dev->spinlock);
+	if (pages->memfd) {
+		for (i = 0; i < count; ++i) {
+			put_page(pages->pages[i]);
+		}
+		fput(pages->memfd);
+	} else {
+		/* The device may have written to the pages */
+		unpin_user_pages_dirty_lock(pages->pages, count, true);
+	}
+}
 
-	/* Disconnect the user */
-	if (dmapp_dev->user[0] == user) {
-		dmapp_dev->user[0] = NULL;
-		if (user->is_locked) {
-			signal_fence = dmapp_dev->fence[1];
+static void dmapp_pages_release(struct dma_buf *dmabuf) {
+	struct dmapp_pages *pages = dmabuf->priv;
+
+	dmapp_pages_put(pages, pages->npages);
+	kvfree(pages->pages);
+	kfree(pages);
+}
+
+static const struct dma_buf_ops dmapp_pages_ops = {
+	.map_dma_buf = dmapp_pages_map,
+	.unmap_dma_buf = dmapp_pages_unmap,
+	.mmap = dmapp_pages_mmap,
+	.vmap = dmapp_pages_vmap,
+	.vunmap = dmapp_pages_vunmap,
+	.release = dmapp_pages_release,
+};
+
+static struct dma_buf *dmapp_pages_export(struct dmapp_pages *pages,
+	const char *exp_name) {
+	struct dma_buf *buf;
+	struct dma_buf_export_info exp_info = {
+		.exp_name = exp_name,
+	};
+
+	exp_info.ops = &dmapp_pages_ops;
+	exp_info.size = pages->npages << PAGE_SHIFT;
+	exp_info.flags = O_RDWR;
+	exp_info.priv = pages;
+
+	buf = dma_buf_export(&exp_info);
+	if (IS_ERR(buf)) {
+		pr_err("dmapp_pages_export: dma_buf_export failed\n");
+	}
+
+	return buf;
+}
+
+static int dmapp_userptr(struct dmapp_device *dmapp_dev,
+	const struct dmapp_userptr_args *args) {
+	struct dmapp_pages *pages;
+	struct dma_buf *buf;
+	int pinned;
+	int ret;
+
+	if (args->flags || (args->size == 0) ||
+		!PAGE_ALIGNED(args->addr) || !PAGE_ALIGNED(args->size) ||
+		(args->size / sizeof(int) > DMAPP_BUFFER_SIZE_MAX)) {
+		return -EINVAL;
+	}
+
+	pages = kzalloc(sizeof(*pages), GFP_KERNEL);
+	if (!pages) {
+		return -ENOMEM;
+	}
+
+	pages->npages = args->size >> PAGE_SHIFT;
+	pages->pages = kvcalloc(pages->npages, sizeof(*pages->pages),
+		GFP_KERNEL);
+	if (!pages->pages) {
+		ret = -ENOMEM;
+		goto err_pages;
+	}
+
+	/* Long term pins keep the pages out of movable zones for the lifetime
+	 * of the dma-buf
+	 */
+	pinned = pin_user_pages_fast(args->addr, pages->npages,
+		FOLL_WRITE | FOLL_LONGTERM, pages->pages);
+	if (pinned < 0) {
+		ret = pinned;
+		goto err_pin;
+	} else if (pinned != pages->npages) {
+		unpin_user_pages(pages->pages, pinned);
+		ret = -EFAULT;
+		goto err_pin;
+	}
+
+	buf = dmapp_pages_export(pages, "dmapp_userptr");
+	if (IS_ERR(buf)) {
+		ret = PTR_ERR(buf);
+		unpin_user_pages(pages->pages, pages->npages);
+		goto err_pin;
+	}
+
+	/* The pages are released with the dma-buf */
+	return dmapp_import_buf(dmapp_dev, buf, buf->size / sizeof(int),
+		NULL);
+
+err_pin:
+	kvfree(pages->pages);
+err_pages:
+	kfree(pages);
+	return ret;
+}
+
+static int dmapp_memfd(struct dmapp_device *dmapp_dev,
+	const struct dmapp_memfd_args *args) {
+	struct dmapp_pages *pages;
+	struct dma_buf *buf;
+	struct file *memfd;
+	unsigned int seals;
+	unsigned long i;
+	struct page *page;
+	pgoff_t pgoff;
+	int ret;
+
+	if (args->flags || (args->size == 0) ||
+		!PAGE_ALIGNED(args->offset) || !PAGE_ALIGNED(args->size) ||
+		(args->size / sizeof(int) > DMAPP_BUFFER_SIZE_MAX)) {
+		return -EINVAL;
+	}
+
+	memfd = fget(args->memfd);
+	if (!memfd) {
+		return -EBADF;
+	}
+
+	/* The memfd must not shrink beneath the dma-buf and must remain
+	 * writable by the device
+	 */
+	if (!shmem_file(memfd)) {
+		ret = -EINVAL;
+		goto err_memfd;
+	}
+	seals = SHMEM_I(file_inode(memfd))->seals;
+	if (!(seals & F_SEAL_SHRINK) || (seals & F_SEAL_WRITE)) {
+		ret = -EINVAL;
+		goto err_memfd;
+	}
+	if ((args->offset > i_size_read(file_inode(memfd))) ||
+		(args->size > i_size_read(file_inode(memfd)) - args->offset)) {
+		ret = -EINVAL;
+		goto err_memfd;
+	}
+
+	pages = kzalloc(sizeof(*pages), GFP_KERNEL);
+	if (!pages) {
+		ret = -ENOMEM;
+		goto err_memfd;
+	}
+
+	pages->npages = args->size >> PAGE_SHIFT;
+	pages->pages = kvcalloc(pages->npages, sizeof(*pages->pages),
+		GFP_KERNEL);
+	if (!pages->pages) {
+		ret = -ENOMEM;
+		goto err_pages;
+	}
+
+	/* The dma-buf and the memfd share the same shmem pages */
+	pgoff = args->offset >> PAGE_SHIFT;
+	for (i = 0; i < pages->npages; ++i) {
+		page = shmem_read_mapping_page(memfd->f_mapping, pgoff + i);
+		if (IS_ERR(page)) {
+			ret = PTR_ERR(page);
+			goto err_page;
 		}
-	} else if (dmapp_dev->user[1] == user) {
-		dmapp_dev->user[1] = NULL;
-		if (user->is_locked) {
-			signal_fence = dmapp_dev->fence[0];
+		pages->pages[i] = page;
+	}
+	pages->memfd = memfd;
+
+	buf = dmapp_pages_export(pages, "dmapp_memfd");
+	if (IS_ERR(buf)) {
+		ret = PTR_ERR(buf);
+		goto err_page;
+	}
+
+	/* The pages and the memfd are released with the dma-buf */
+	return dmapp_import_buf(dmapp_dev, buf, buf->size / sizeof(int),
+		NULL);
+
+err_page:
+	while (i-- > 0) {
+		put_page(pages->pages[i]);
+	}
+	kvfree(pages->pages);
+err_pages:
+	kfree(pages);
+err_memfd:
+	fput(memfd);
+	return ret;
+}
+
+/* Reports the node of the buffer (or NUMA_NO_NODE when it is unknown)
+ * and whether its pages span several nodes
+ */
+static void dmapp_buf_node(struct dmapp_device *dmapp_dev,
+	struct dmapp_node_args *args) {
+	struct dmapp_pages *pages;
+	struct dma_buf *buf;
+	bool mixed = false;
+	unsigned long i;
+
+	args->node = NUMA_NO_NODE;
+	args->flags = 0;
+
+	buf = dmapp_buf_get(dmapp_dev);
+	if (buf->ops == &dmapp_dmabuf_ops) {
+		args->node = dmapp_buffer_node(buf->priv, &mixed);
+	} else if (buf->ops == &dmapp_pages_ops) {
+		pages = buf->priv;
+		args->node = page_to_nid(pages->pages[0]);
+		for (i = 1; i < pages->npages; ++i) {
+			if (page_to_nid(pages->pages[i]) != args->node) {
+				mixed = true;
+				break;
+			}
 		}
 	}
+	dma_buf_put(buf);
 
-	spin_unlock(&dmapp_dev->spinlock);
+	if (mixed) {
+		args->flags |= DMAPP_NODE_MIXED;
+	}
+}
 
-	file->private_data = NULL;
-	kfree(user);
+/* Export a new dmapp buffer of size bytes on the node */
+static struct dma_buf *dmapp_buffer_export(struct dmapp_device *dmapp_dev,
+	size_t size, int node) {
+	struct dmapp_buffer *buffer;
+	struct dma_buf *buf;
+	struct dma_buf_export_info exp_info = {
+		.exp_name = "dmapp_buffer",
+	};
 
-	/* Optionally reset the signal_fence to prevent deadlocks */
-	if (signal_fence && !dma_fence_is_signaled(signal_fence)) {
-		ret = dma_fence_signal(signal_fence);
-		if (ret < 0) {
-			/* Signal may fail if the fence was previously signaled */
-			pr_err("dmapp_cdev_release: dma_fence_signal failed (%i)\n", ret);
+	buffer = dmapp_buffer_alloc(dmapp_dev->device, size, node);
+	if (!buffer) {
+		return ERR_PTR(-ENOMEM);
+	}
+
+	exp_info.ops = &dmapp_dmabuf_ops;
+	exp_info.size = buffer->size;
+	exp_info.flags = O_RDWR;
+	exp_info.priv = buffer;
+
+	buf = dma_buf_export(&exp_info);
+	if (IS_ERR(buf)) {
+		pr_err("dmapp_buffer_export: dma_buf_export failed\n");
+		dmapp_buffer_free(buffer);
+	}
+
+	return buf;
+}
+
+static int dmapp_set_node(struct dmapp_device *dmapp_dev,
+	const struct dmapp_node_args *args) {
+	struct dmapp_layout_args layout;
+	struct dma_buf *buf;
+	int node = args->node;
+	u32 size;
+
+	if (args->flags) {
+		return -EINVAL;
+	}
+
+	/* Place the buffer near the caller by default */
+	if (node < 0) {
+		node = numa_node_id();
+	} else if ((node >= nr_node_ids) || !node_online(node)) {
+		return -EINVAL;
+	}
+
+	/* The buffer moves but keeps its size and layout */
+	spin_lock_irq(&dmapp_dev->spinlock);
+	size = dmapp_dev->size;
+	layout = dmapp_dev->layout;
+	spin_unlock_irq(&dmapp_dev->spinlock);
+
+	buf = dmapp_buffer_export(dmapp_dev, size * sizeof(int), node);
+	if (IS_ERR(buf)) {
+		return PTR_ERR(buf);
+	}
+
+	return dmapp_import_buf(dmapp_dev, buf, size, &layout);
+}
+
+struct dmapp_format {
+	u32 format;
+	u32 num_planes;
+	u32 cpp[DMAPP_PLANES_MAX];
+	u32 hsub;
+	u32 vsub;
+};
+
+static const struct dmapp_format dmapp_formats[] = {
+	{ DRM_FORMAT_R8, 1, { 1 }, 1, 1 },
+	{ DRM_FORMAT_RGB565, 1, { 2 }, 1, 1 },
+	{ DRM_FORMAT_XRGB8888, 1, { 4 }, 1, 1 },
+	{ DRM_FORMAT_ARGB8888, 1, { 4 }, 1, 1 },
+	{ DRM_FORMAT_NV12, 2, { 1, 2 }, 2, 2 },
+	{ DRM_FORMAT_NV16, 2, { 1, 2 }, 2, 1 },
+	{ DRM_FORMAT_P010, 2, { 2, 4 }, 2, 2 },
+	{ DRM_FORMAT_YUV420, 3, { 1, 1, 1 }, 2, 2 },
+};
+
+static const struct dmapp_format *dmapp_format_find(u32 format) {
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(dmapp_formats); ++i) {
+		if (dmapp_formats[i].format == format) {
+			return &dmapp_formats[i];
 		}
 	}
 
-	if (!ret) {
-		pr_info("dmapp_cdev_release: success\n");
+	return NULL;
+}
+
+/* Validate the layout (or compute the planes when num_planes is zero) and
+ * fill in the align, num_planes and size
+ */
+static int dmapp_layout_init(struct dmapp_layout_args *args) {
+	const struct dmapp_format *fmt;
+	u32 align = args->align ? args->align : DMAPP_LAYOUT_ALIGN;
+	bool blocked = args->flags & DMAPP_LAYOUT_BLOCKED;
+	u32 base = align;
+	u64 offset = 0;
+	u64 end = 0;
+	u32 width;
+	u32 height;
+	u32 row;
+	int i;
+
+	fmt = dmapp_format_find(args->format);
+	if (!fmt || (args->flags & ~DMAPP_LAYOUT_BLOCKED) || args->pad ||
+		(args->width == 0) || (args->width > DMAPP_LAYOUT_DIM_MAX) ||
+		(args->height == 0) || (args->height > DMAPP_LAYOUT_DIM_MAX) ||
+		!is_power_of_2(align) || (align > PAGE_SIZE)) {
+		return -EINVAL;
+	}
+
+	if (args->num_planes && (args->num_planes != fmt->num_planes)) {
+		return -EINVAL;
+	}
+
+	/* Blocked planes hold whole rows of blocks and start on a block */
+	if (blocked) {
+		align = max_t(u32, align, DMAPP_BLOCK_WIDTH);
+		base = DMAPP_BLOCK_SIZE;
+	}
+
+	for (i = 0; i < fmt->num_planes; ++i) {
+		width = i ? DIV_ROUND_UP(args->width, fmt->hsub) : args->width;
+		height = i ? DIV_ROUND_UP(args->height, fmt->vsub) : args->height;
+		row = width * fmt->cpp[i];
+		if (blocked) {
+			height = ALIGN(height, DMAPP_BLOCK_HEIGHT);
+		}
+
+		if (args->num_planes == 0) {
+			args->planes[i].offset = offset;
+			args->planes[i].stride = ALIGN(row, align);
+		} else if (!IS_ALIGNED(args->planes[i].offset, base) ||
+			!IS_ALIGNED(args->planes[i].stride, align) ||
+			(args->planes[i].stride < row)) {
+			return -EINVAL;
+		}
+
+		offset = (u64) args->planes[i].offset +
+			(u64) args->planes[i].stride * height;
+		end = max(end, offset);
+		offset = ALIGN(offset, base);
+	}
+
+	for (; i < DMAPP_PLANES_MAX; ++i) {
+		args->planes[i].offset = 0;
+		args->planes[i].stride = 0;
+	}
+
+	end = PAGE_ALIGN(end);
+	if (end > DMAPP_BUFFER_SIZE_MAX * sizeof(int)) {
+		return -E2BIG;
+	}
+
+	args->align = align;
+	args->num_planes = fmt->num_planes;
+	args->size = end;
+
+	return 0;
+}
+
+static int dmapp_set_layout(struct dmapp_device *dmapp_dev,
+	struct dmapp_layout_args *args) {
+	struct dma_buf *buf;
+	int ret;
+
+	ret = dmapp_layout_init(args);
+	if (ret < 0) {
+		return ret;
+	}
+
+	buf = dmapp_buffer_export(dmapp_dev, args->size, NUMA_NO_NODE);
+	if (IS_ERR(buf)) {
+		return PTR_ERR(buf);
+	}
+
+	return dmapp_import_buf(dmapp_dev, buf, args->size / sizeof(int), args);
+}
+
+static void dmapp_get_layout(struct dmapp_device *dmapp_dev,
+	struct dmapp_layout_args *args) {
+	spin_lock_irq(&dmapp_dev->spinlock);
+	*args = dmapp_dev->layout;
+	spin_unlock_irq(&dmapp_dev->spinlock);
+}
+
+/* Publish the record of the frame which the unlock signals. Only the lock
+ * holder writes the record of its parity so no lock is required. The
+ * store-release of signaled[parity] by the unlock orders the record before
+ * the seqno for readers which pair it with a load-acquire.
+ */
+static int dmapp_meta_publish(struct dmapp_device *dmapp_dev, int parity,
+	struct dma_fence *signal_fence, struct dmapp_meta_args *args) {
+	if (args->size > DMAPP_META_DATA_SIZE) {
+		return -EINVAL;
+	}
+
+	args->frame = signal_fence->seqno;
+	if (args->timestamp_ns == 0) {
+		args->timestamp_ns = ktime_get_ns();
+	}
+
+	memcpy(&dmapp_dev->meta_page->meta[parity], args, sizeof(*args));
+
+	return 0;
+}
+
+/* Initialize the fence of the next seqno of the suballocation. The caller
+ * must hold the spinlock.
+ */
+static void dmapp_sub_fence_init_locked(struct dmapp_device *dmapp_dev,
+	struct dmapp_sub *sub, struct dma_fence *fence) {
+	dma_fence_init(fence, &dmapp_fence_ops, &dmapp_dev->spinlock,
+		sub->context, sub->seqno + 1);
+	sub->fence = fence;
+}
+
+/* The pool is created on demand over the current buffer. The caller must
+ * hold the sub_lock.
+ */
+static int dmapp_sub_pool_init(struct dmapp_device *dmapp_dev) {
+	size_t size = ALIGN_DOWN(dmapp_dev->size * sizeof(int),
+		1 << DMAPP_SUB_ORDER);
+	struct gen_pool *pool;
+	int ret;
+
+	if (dmapp_dev->sub_pool) {
+		return 0;
+	}
+
+	if (size == 0) {
+		return -ENOSPC;
+	}
+
+	pool = gen_pool_create(DMAPP_SUB_ORDER, NUMA_NO_NODE);
+	if (!pool) {
+		return -ENOMEM;
+	}
+
+	/* Offsets are biased since gen_pool_alloc fails with zero */
+	ret = gen_pool_add(pool, DMAPP_SUB_BASE, size, NUMA_NO_NODE);
+	if (ret < 0) {
+		gen_pool_destroy(pool);
+		return ret;
+	}
+
+	dmapp_dev->sub_pool = pool;
+	return 0;
+}
+
+static int dmapp_sub_alloc(struct dmapp_user *user,
+	struct dmapp_sub_args *args) {
+	struct dmapp_device *dmapp_dev = user->dmapp_dev;
+	struct dma_fence *fence;
+	struct dmapp_sub *sub;
+	unsigned long addr;
+	int ret;
+
+	if (args->flags || (args->size == 0)) {
+		return -EINVAL;
+	}
+
+	sub = kzalloc(sizeof(*sub), GFP_KERNEL);
+	if (!sub) {
+		return -ENOMEM;
+	}
+
+	fence = dmapp_fence_alloc();
+	if (!fence) {
+		ret = -ENOMEM;
+		goto err_fence;
+	}
+
+	sub->owner = user;
+	sub->size = ALIGN(args->size, 1 << DMAPP_SUB_ORDER);
+	sub->context = dma_fence_context_alloc(1);
+
+	mutex_lock(&dmapp_dev->sub_lock);
+	ret = dmapp_sub_pool_init(dmapp_dev);
+	if (ret < 0) {
+		goto err_pool;
+	}
+
+	addr = gen_pool_alloc(dmapp_dev->sub_pool, sub->size);
+	if (!addr) {
+		ret = -ENOSPC;
+		goto err_pool;
+	}
+	sub->offset = addr - DMAPP_SUB_BASE;
+
+	ret = idr_alloc(&dmapp_dev->subs, sub, 1, 0, GFP_KERNEL);
+	if (ret < 0) {
+		gen_pool_free(dmapp_dev->sub_pool, addr, sub->size);
+		goto err_pool;
 	}
+	args->handle = ret;
+	args->offset = sub->offset;
+	args->size = sub->size;
+	args->seqno = 0;
+
+	spin_lock_irq(&dmapp_dev->spinlock);
+	dmapp_sub_fence_init_locked(dmapp_dev, sub, fence);
+	spin_unlock_irq(&dmapp_dev->spinlock);
+
+	++dmapp_dev->sub_count;
+	mutex_unlock(&dmapp_dev->sub_lock);
 
+	return 0;
+
+err_pool:
+	mutex_unlock(&dmapp_dev->sub_lock);
+	kfree(container_of(fence, struct dmapp_fence, base));
+err_fence:
+	kfree(sub);
 	return ret;
 }
 
-static const char *dmapp_fence_get_driver_name(struct dma_fence *fence)
-{
-	return "dmapp";
-}
+/* Cancel any waiters and release the suballocation. The caller must hold
+ * the sub_lock.
+ */
+static void dmapp_sub_release(struct dmapp_device *dmapp_dev,
+	struct dmapp_sub *sub) {
+	dma_fence_set_error(sub->fence, -ECANCELED);
+	dma_fence_signal(sub->fence);
+	dma_fence_put(sub->fence);
+
+	gen_pool_free(dmapp_dev->sub_pool, sub->offset + DMAPP_SUB_BASE,
+		sub->size);
+	--dmapp_dev->sub_count;
+	kfree(sub);
+}
+
+/* Release the suballocations of a user which is closed */
+static void dmapp_sub_release_user(struct dmapp_user *user) {
+	struct dmapp_device *dmapp_dev = user->dmapp_dev;
+	struct dmapp_sub *sub;
+	int id;
+
+	mutex_lock(&dmapp_dev->sub_lock);
+	idr_for_each_entry(&dmapp_dev->subs, sub, id) {
+		if (sub->owner == user) {
+			idr_remove(&dmapp_dev->subs, id);
+			dmapp_sub_release(dmapp_dev, sub);
+		}
+	}
+	mutex_unlock(&dmapp_dev->sub_lock);
+}
+
+/* Only the owner may signal or free a suballocation. The caller must hold
+ * the sub_lock.
+ */
+static struct dmapp_sub *dmapp_sub_find_owned(struct dmapp_user *user,
+	u32 handle) {
+	struct dmapp_sub *sub;
+
+	sub = idr_find(&user->dmapp_dev->subs, handle);
+	if (!sub || (sub->owner != user)) {
+		return NULL;
+	}
+
+	return sub;
+}
+
+static int dmapp_sub_free(struct dmapp_user *user,
+	const struct dmapp_sub_args *args) {
+	struct dmapp_device *dmapp_dev = user->dmapp_dev;
+	struct dmapp_sub *sub;
+
+	mutex_lock(&dmapp_dev->sub_lock);
+	sub = dmapp_sub_find_owned(user, args->handle);
+	if (sub) {
+		idr_remove(&dmapp_dev->subs, args->handle);
+		dmapp_sub_release(dmapp_dev, sub);
+	}
+	mutex_unlock(&dmapp_dev->sub_lock);
+
+	return sub ? 0 : -ENOENT;
+}
+
+static int dmapp_sub_signal(struct dmapp_user *user,
+	struct dmapp_sub_args *args) {
+	struct dmapp_device *dmapp_dev = user->dmapp_dev;
+	struct dma_fence *next;
+	struct dma_fence *fence;
+	struct dmapp_sub *sub;
+
+	next = dmapp_fence_alloc();
+	if (!next) {
+		return -ENOMEM;
+	}
+
+	mutex_lock(&dmapp_dev->sub_lock);
+	sub = dmapp_sub_find_owned(user, args->handle);
+	if (!sub) {
+		mutex_unlock(&dmapp_dev->sub_lock);
+		kfree(container_of(next, struct dmapp_fence, base));
+		return -ENOENT;
+	}
+
+	spin_lock_irq(&dmapp_dev->spinlock);
+	fence = sub->fence;
+	args->seqno = ++sub->seqno;
+	dmapp_sub_fence_init_locked(dmapp_dev, sub, next);
+	spin_unlock_irq(&dmapp_dev->spinlock);
+	mutex_unlock(&dmapp_dev->sub_lock);
+
+	dma_fence_signal(fence);
+	dma_fence_put(fence);
+
+	return 0;
+}
+
+/* Any user may wait for a suballocation */
+static int dmapp_sub_wait(struct dmapp_device *dmapp_dev,
+	struct dmapp_sub_args *args) {
+	ktime_t deadline = ktime_add_ns(ktime_get(), args->timeout_ns);
+	s64 timeout_ns = args->timeout_ns;
+	u64 target = args->seqno;
+	struct dma_fence *fence;
+	struct dmapp_sub *sub;
+	int ret;
+
+	/* Each fence covers the next signal so wait until the seqno passes */
+	while (1) {
+		mutex_lock(&dmapp_dev->sub_lock);
+		sub = idr_find(&dmapp_dev->subs, args->handle);
+		if (!sub) {
+			mutex_unlock(&dmapp_dev->sub_lock);
+			return -ENOENT;
+		}
+
+		fence = NULL;
+		spin_lock_irq(&dmapp_dev->spinlock);
+		if (sub->seqno <= target) {
+			fence = dma_fence_get(sub->fence);
+		}
+		args->seqno = sub->seqno;
+		spin_unlock_irq(&dmapp_dev->spinlock);
+		mutex_unlock(&dmapp_dev->sub_lock);
+
+		if (!fence) {
+			return 0;
+		}
+
+		if (args->timeout_ns >= 0) {
+			timeout_ns = ktime_to_ns(ktime_sub(deadline, ktime_get()));
+			if (timeout_ns <= 0) {
+				dma_fence_put(fence);
+				return -ETIMEDOUT;
+			}
+		}
 
-static const char *dmapp_fence_get_timeline_name(struct dma_fence *fence)
-{
-	return "dmapp_timeline";
+		ret = dmapp_fence_wait(dmapp_dev, fence, timeout_ns, false);
+		if ((ret == 0) && (fence->error < 0)) {
+			ret = fence->error;
+		}
+		dma_fence_put(fence);
+		if (ret < 0) {
+			return ret;
+		}
+	}
 }
 
-static const struct dma_fence_ops dmapp_fence_ops = {
-	.get_driver_name = dmapp_fence_get_driver_name,
-	.get_timeline_name = dmapp_fence_get_timeline_name,
-};
-
 static long dmapp_cdev_ioctl(struct file *file, unsigned int cmd,
 	unsigned long arg) {
 	struct dmapp_user *user = file->private_data;
 	struct dmapp_device *dmapp_dev = user->dmapp_dev;
 	struct dma_fence *signal_fence;
 	struct dma_fence *wait_fence;
+	struct dmapp_lock_args lock_args = {
+		.timeout_ns = -1,
+	};
+	struct dmapp_wait_multi_args wait_multi_args;
+	struct dmapp_job_args job_args;
+	struct dmapp_forward_args forward_args;
+	struct dmapp_tile_args tile_args;
+	struct dmapp_lock_multi_args lock_multi_args;
+	struct dmapp_ring_wait_args ring_wait_args;
+	struct dmapp_damage_args damage_args;
+	struct dmapp_import_args import_args;
+	struct dmapp_userptr_args userptr_args;
+	struct dmapp_memfd_args memfd_args;
+	struct dmapp_node_args node_args;
+	struct dmapp_sub_args sub_args;
+	struct dmapp_layout_args layout_args;
+	struct dmapp_meta_args meta_args;
+	struct dma_buf *buf;
+	bool is_locked = false;
 	int ret = 0;
 	int parity;
 
-	spin_lock(&dmapp_dev->spinlock);
+	if (user->is_reader) {
+		return dmapp_reader_ioctl(user, cmd, arg);
+	}
+
+	/* Copy the lock arguments before taking the spinlock */
+	if ((cmd == DMAPP_IOCTL_BUFFER_LOCK_TIMEOUT) ||
+		(cmd == DMAPP_IOCTL_BUFFER_SWAP_TIMEOUT)) {
+		if (copy_from_user(&lock_args, (struct dmapp_lock_args __user *) arg,
+			sizeof(lock_args))) {
+			return -EFAULT;
+		}
+	} else if (cmd == DMAPP_IOCTL_FORWARD) {
+		if (copy_from_user(&forward_args,
+			(struct dmapp_forward_args __user *) arg, sizeof(forward_args))) {
+			return -EFAULT;
+		}
+	} else if ((cmd == DMAPP_IOCTL_TILE_UNLOCK) ||
+		(cmd == DMAPP_IOCTL_TILE_WAIT)) {
+		if (copy_from_user(&tile_args, (struct dmapp_tile_args __user *) arg,
+			sizeof(tile_args))) {
+			return -EFAULT;
+		}
+	}
+
+	spin_lock_irq(&dmapp_dev->spinlock);
 
 	/* Validate user, determine parity and assign fences */
 	if (dmapp_dev->user[0] == user) {
 		parity = 0;
-		signal_fence = dmapp_dev->fence[1];
-		wait_fence = dmapp_dev->fence[0];
 	} else if (dmapp_dev->user[1] == user) {
 		parity = 1;
-		signal_fence = dmapp_dev->fence[0];
-		wait_fence = dmapp_dev->fence[1];
 	} else {
-		spin_unlock(&dmapp_dev->spinlock);
+		spin_unlock_irq(&dmapp_dev->spinlock);
 		pr_err("dmapp_cdev_ioctl: invalid user\n");
 		return -EINVAL;
 	}
 
+	/* The lock protocol belongs to the relay while forwarding */
+	if (user->forward) {
+		switch (cmd) {
+		case DMAPP_IOCTL_BUFFER_LOCK:
+		case DMAPP_IOCTL_BUFFER_LOCK_TIMEOUT:
+		case DMAPP_IOCTL_BUFFER_UNLOCK:
+		case DMAPP_IOCTL_BUFFER_UNLOCK_META:
+		case DMAPP_IOCTL_BUFFER_UNLOCK_DAMAGE:
+		case DMAPP_IOCTL_BUFFER_SWAP:
+		case DMAPP_IOCTL_BUFFER_SWAP_TIMEOUT:
+		case DMAPP_IOCTL_JOB_SUBMIT:
+		case DMAPP_IOCTL_TILE_UNLOCK:
+			spin_unlock_irq(&dmapp_dev->spinlock);
+			return -EBUSY;
+		}
+	}
+
 	/* Handle commands that require synchronization */
 	switch (cmd) {
 	case DMAPP_IOCTL_BUFFER_LOCK:
+	case DMAPP_IOCTL_BUFFER_LOCK_TIMEOUT:
 		if (user->is_locked) {
 			/* Ignore ioctl when already in locked state */
-			spin_unlock(&dmapp_dev->spinlock);
+			spin_unlock_irq(&dmapp_dev->spinlock);
 			return 0;
 		}
 		break;
 	case DMAPP_IOCTL_BUFFER_UNLOCK:
+	case DMAPP_IOCTL_BUFFER_UNLOCK_META:
+	case DMAPP_IOCTL_BUFFER_UNLOCK_DAMAGE:
 		if (!user->is_locked) {
 			/* Ignore ioctl when already in unlocked state */
-			spin_unlock(&dmapp_dev->spinlock);
+			spin_unlock_irq(&dmapp_dev->spinlock);
 			return 0;
 		}
 		break;
+	case DMAPP_IOCTL_BUFFER_SWAP:
+	case DMAPP_IOCTL_BUFFER_SWAP_TIMEOUT:
+		/* Only signal the next user when we currently hold the buffer */
+		is_locked = user->is_locked;
+		break;
 	}
 
-	spin_unlock(&dmapp_dev->spinlock);
+	/* Hold fence references since the lock path replaces them */
+	signal_fence = dma_fence_get(dmapp_dev->fence[1 - parity]);
+	wait_fence = dma_fence_get(dmapp_dev->fence[parity]);
+
+	spin_unlock_irq(&dmapp_dev->spinlock);
 
 	/* Handle commands that might sleep or do not require synchronization */
 	switch (cmd) {
 	case DMAPP_IOCTL_GET_BUFFER_SIZE:
 		pr_info("DMAPP_IOCTL_GET_BUFFER_SIZE\n");
-		return DMAPP_BUFFER_SIZE;
+		ret = dmapp_dev->size;
+		break;
 	case DMAPP_IOCTL_GET_BUFFER_PARITY:
 		pr_info("DMAPP_IOCTL_GET_BUFFER_PARITY\n");
-		return parity;
+		ret = parity;
+		break;
 	case DMAPP_IOCTL_GET_BUFFER_FD:
 		pr_info("DMAPP_IOCTL_GET_BUFFER_FD\n");
-		ret = dma_buf_fd(dmapp_dev->buf, 0);
+		/* The fd owns a reference to the buffer */
+		buf = dmapp_buf_get(dmapp_dev);
+		ret = dma_buf_fd(buf, 0);
 		if (ret < 0) {
 			pr_err("dmapp_cdev_ioctl: dma_buf_fd failed with %i\n", ret);
+			dma_buf_put(buf);
 		}
 		break;
 	case DMAPP_IOCTL_BUFFER_LOCK:
+	case DMAPP_IOCTL_BUFFER_LOCK_TIMEOUT:
 		pr_info("DMAPP_IOCTL_BUFFER_LOCK\n");
-		/* Wait for our turn to process the buffer */
-		ret = dma_fence_wait(wait_fence, true);
-		if (ret < 0) {
-			/* Wait may fail if interrupted by a signal */
-			pr_err("dmapp_cdev_ioctl: dma_fence_wait failed (%i)\n", ret);
-		} else {
-			/* Reinitialize wait_fence for the next pass and set the locked flag */
-			spin_lock(&dmapp_dev->spinlock);
-			dma_fence_init(wait_fence, &dmapp_fence_ops, &dmapp_dev->spinlock, 0,
-				parity);
-			user->is_locked = true;
-			spin_unlock(&dmapp_dev->spinlock);
-		}
+		ret = dmapp_buffer_lock(user, parity, wait_fence, &lock_args);
 		break;
 	case DMAPP_IOCTL_BUFFER_UNLOCK:
 		pr_info("DMAPP_IOCTL_BUFFER_UNLOCK\n");
-		/* Signal the next user that it may begin */
-		ret = dma_fence_signal(signal_fence);
-		if (ret < 0) {
-			/* Signal may fail if the fence was previously signaled */
-			pr_err("dmapp_cdev_ioctl: dma_fence_signal failed (%i)\n", ret);
+		ret = dmapp_buffer_unlock(user, parity, signal_fence);
+		break;
+	case DMAPP_IOCTL_BUFFER_UNLOCK_META:
+		pr_info("DMAPP_IOCTL_BUFFER_UNLOCK_META\n");
+		if (copy_from_user(&meta_args, (struct dmapp_meta_args __user *) arg,
+			sizeof(meta_args))) {
+			ret = -EFAULT;
+			break;
 		}
 
-		/* Clear the locked flag */
-		spin_lock(&dmapp_dev->spinlock);
-		user->is_locked = false;
-		spin_unlock(&dmapp_dev->spinlock);
+		ret = dmapp_meta_publish(dmapp_dev, parity, signal_fence, &meta_args);
+		if (ret == 0) {
+			ret = dmapp_buffer_unlock(user, parity, signal_fence);
+		}
+		break;
+	case DMAPP_IOCTL_BUFFER_UNLOCK_DAMAGE:
+		pr_info("DMAPP_IOCTL_BUFFER_UNLOCK_DAMAGE\n");
+		if (copy_from_user(&damage_args,
+			(struct dmapp_damage_args __user *) arg, sizeof(damage_args))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		ret = dmapp_damage_set(user, &damage_args);
+		if (ret == 0) {
+			ret = dmapp_buffer_unlock(user, parity, signal_fence);
+		}
+		break;
+	case DMAPP_IOCTL_BUFFER_SWAP:
+	case DMAPP_IOCTL_BUFFER_SWAP_TIMEOUT:
+		pr_info("DMAPP_IOCTL_BUFFER_SWAP\n");
+		/* Hand the buffer to the next user and wait for our next turn in a
+		 * single kernel entry
+		 */
+		if (is_locked) {
+			/* Signal failures are logged but must not prevent the wait */
+			dmapp_buffer_unlock(user, parity, signal_fence);
+		}
+		ret = dmapp_buffer_lock(user, parity, wait_fence, &lock_args);
+		break;
+	case DMAPP_IOCTL_WAIT_MULTI:
+		pr_info("DMAPP_IOCTL_WAIT_MULTI\n");
+		if (copy_from_user(&wait_multi_args,
+			(struct dmapp_wait_multi_args __user *) arg,
+			sizeof(wait_multi_args))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		/* Report the locked entries even if a lock failed */
+		ret = dmapp_wait_multi(dmapp_dev, &wait_multi_args);
+		if (copy_to_user((struct dmapp_wait_multi_args __user *) arg,
+			&wait_multi_args, sizeof(wait_multi_args))) {
+			ret = -EFAULT;
+		}
+		break;
+	case DMAPP_IOCTL_JOB_SUBMIT:
+		pr_info("DMAPP_IOCTL_JOB_SUBMIT\n");
+		if (copy_from_user(&job_args, (struct dmapp_job_args __user *) arg,
+			sizeof(job_args))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		ret = dmapp_job_submit(user, parity, signal_fence, &job_args);
+		if ((ret == 0) && put_user(job_args.fence_fd,
+			&((struct dmapp_job_args __user *) arg)->fence_fd)) {
+			/* The fd was installed so it is left to the process */
+			ret = -EFAULT;
+		}
+		break;
+	case DMAPP_IOCTL_FORWARD:
+		pr_info("DMAPP_IOCTL_FORWARD\n");
+		ret = dmapp_forward(user, parity, &forward_args);
+		break;
+	case DMAPP_IOCTL_LOCK_MULTI:
+		pr_info("DMAPP_IOCTL_LOCK_MULTI\n");
+		if (copy_from_user(&lock_multi_args,
+			(struct dmapp_lock_multi_args __user *) arg,
+			sizeof(lock_multi_args))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		ret = dmapp_lock_multi(&lock_multi_args);
+		break;
+	case DMAPP_IOCTL_SET_DAMAGE:
+		pr_info("DMAPP_IOCTL_SET_DAMAGE\n");
+		if (copy_from_user(&damage_args,
+			(struct dmapp_damage_args __user *) arg, sizeof(damage_args))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		ret = dmapp_damage_set(user, &damage_args);
+		break;
+	case DMAPP_IOCTL_GET_DAMAGE:
+		pr_info("DMAPP_IOCTL_GET_DAMAGE\n");
+		ret = dmapp_damage_get(user, &damage_args);
+		if ((ret == 0) && copy_to_user((struct dmapp_damage_args __user *) arg,
+			&damage_args, sizeof(damage_args))) {
+			ret = -EFAULT;
+		}
+		break;
+	case DMAPP_IOCTL_RING_INIT:
+		pr_info("DMAPP_IOCTL_RING_INIT\n");
+		ret = dmapp_ring_init(user);
+		break;
+	case DMAPP_IOCTL_RING_WAIT:
+		/* The doorbell is on the streaming fast path so it is not logged */
+		if (copy_from_user(&ring_wait_args,
+			(struct dmapp_ring_wait_args __user *) arg,
+			sizeof(ring_wait_args))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		ret = dmapp_ring_wait(dmapp_dev, &ring_wait_args);
+		break;
+	case DMAPP_IOCTL_RING_WAKE:
+		ret = dmapp_ring_wake(dmapp_dev);
+		break;
+	case DMAPP_IOCTL_TILE_UNLOCK:
+	case DMAPP_IOCTL_TILE_WAIT:
+		ret = dmapp_tile(user, parity, cmd, &tile_args);
+		if ((ret == 0) && copy_to_user((struct dmapp_tile_args __user *) arg,
+			&tile_args, sizeof(tile_args))) {
+			ret = -EFAULT;
+		}
+		break;
+	case DMAPP_IOCTL_IMPORT:
+		pr_info("DMAPP_IOCTL_IMPORT\n");
+		if (copy_from_user(&import_args,
+			(struct dmapp_import_args __user *) arg, sizeof(import_args))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		ret = dmapp_import(dmapp_dev, &import_args);
+		break;
+	case DMAPP_IOCTL_USERPTR:
+		pr_info("DMAPP_IOCTL_USERPTR\n");
+		if (copy_from_user(&userptr_args,
+			(struct dmapp_userptr_args __user *) arg, sizeof(userptr_args))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		ret = dmapp_userptr(dmapp_dev, &userptr_args);
+		break;
+	case DMAPP_IOCTL_MEMFD:
+		pr_info("DMAPP_IOCTL_MEMFD\n");
+		if (copy_from_user(&memfd_args,
+			(struct dmapp_memfd_args __user *) arg, sizeof(memfd_args))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		ret = dmapp_memfd(dmapp_dev, &memfd_args);
+		break;
+	case DMAPP_IOCTL_SET_NODE:
+		pr_info("DMAPP_IOCTL_SET_NODE\n");
+		if (copy_from_user(&node_args, (struct dmapp_node_args __user *) arg,
+			sizeof(node_args))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		ret = dmapp_set_node(dmapp_dev, &node_args);
+		break;
+	case DMAPP_IOCTL_GET_NODE:
+		dmapp_buf_node(dmapp_dev, &node_args);
+		if (copy_to_user((struct dmapp_node_args __user *) arg, &node_args,
+			sizeof(node_args))) {
+			ret = -EFAULT;
+		}
+		break;
+	case DMAPP_IOCTL_SET_LAYOUT:
+		pr_info("DMAPP_IOCTL_SET_LAYOUT\n");
+		if (copy_from_user(&layout_args,
+			(struct dmapp_layout_args __user *) arg, sizeof(layout_args))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		ret = dmapp_set_layout(dmapp_dev, &layout_args);
+		if ((ret >= 0) && copy_to_user((struct dmapp_layout_args __user *) arg,
+			&layout_args, sizeof(layout_args))) {
+			ret = -EFAULT;
+		}
+		break;
+	case DMAPP_IOCTL_GET_LAYOUT:
+		dmapp_get_layout(dmapp_dev, &layout_args);
+		if (copy_to_user((struct dmapp_layout_args __user *) arg,
+			&layout_args, sizeof(layout_args))) {
+			ret = -EFAULT;
+		}
+		break;
+	case DMAPP_IOCTL_SUB_ALLOC:
+	case DMAPP_IOCTL_SUB_FREE:
+	case DMAPP_IOCTL_SUB_SIGNAL:
+	case DMAPP_IOCTL_SUB_WAIT:
+		/* Suballocation fences are on the fast path so they are not logged */
+		if (copy_from_user(&sub_args, (struct dmapp_sub_args __user *) arg,
+			sizeof(sub_args))) {
+			ret = -EFAULT;
+			break;
+		}
+
+		if (cmd == DMAPP_IOCTL_SUB_ALLOC) {
+			ret = dmapp_sub_alloc(user, &sub_args);
+		} else if (cmd == DMAPP_IOCTL_SUB_FREE) {
+			ret = dmapp_sub_free(user, &sub_args);
+		} else if (cmd == DMAPP_IOCTL_SUB_SIGNAL) {
+			ret = dmapp_sub_signal(user, &sub_args);
+		} else {
+			ret = dmapp_sub_wait(dmapp_dev, &sub_args);
+		}
+
+		if ((ret == 0) && (cmd != DMAPP_IOCTL_SUB_FREE) &&
+			copy_to_user((struct dmapp_sub_args __user *) arg, &sub_args,
+			sizeof(sub_args))) {
+			ret = -EFAULT;
+		}
 		break;
 	default:
 		pr_err("dmapp_cdev_ioctl: %u failed\n", cmd);
 		ret = -ENOTTY;
 	}
 
+	dma_fence_put(wait_fence);
+	dma_fence_put(signal_fence);
+
+	return ret;
+}
+
+/* The mirror keeps the buffer (and its pages) alive while it is mapped
+ * even when the buffer of the device is replaced
+ */
+static void dmapp_mirror_vm_open(struct vm_area_struct *vma) {
+	get_dma_buf(vma->vm_private_data);
+}
+
+static void dmapp_mirror_vm_close(struct vm_area_struct *vma) {
+	dma_buf_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct dmapp_mirror_vm_ops = {
+	.open = dmapp_mirror_vm_open,
+	.close = dmapp_mirror_vm_close,
+};
+
+static int dmapp_cdev_mmap_mirror(struct dmapp_device *dmapp_dev,
+	struct vm_area_struct *vma) {
+	struct dmapp_buffer *buffer;
+	unsigned long offset = (vma->vm_pgoff << PAGE_SHIFT) - DMAPP_MMAP_MIRROR;
+	unsigned long size = (vma->vm_end - vma->vm_start) / 2;
+	struct dma_buf *buf;
+	int ret;
+
+	buf = dmapp_buf_get(dmapp_dev);
+
+	/* Only the pages of dmapp buffers are known */
+	if (buf->ops != &dmapp_dmabuf_ops) {
+		pr_err("dmapp_cdev_mmap: mirror of an imported buffer\n");
+		ret = -EINVAL;
+		goto err_mirror;
+	}
+	buffer = buf->priv;
+
+	if ((vma_pages(vma) % 2) || (offset > buffer->size) ||
+		(size > buffer->size - offset)) {
+		pr_err("dmapp_cdev_mmap: invalid mirror range\n");
+		ret = -EINVAL;
+		goto err_mirror;
+	}
+
+	/* Map the same pages into both halves of the vma */
+	ret = dmapp_buffer_remap(vma, vma->vm_start, buffer, offset, size);
+	if (ret < 0) {
+		goto err_mirror;
+	}
+
+	ret = dmapp_buffer_remap(vma, vma->vm_start + size, buffer, offset,
+		size);
+	if (ret < 0) {
+		goto err_mirror;
+	}
+
+	/* The vma owns the buffer reference */
+	vma->vm_ops = &dmapp_mirror_vm_ops;
+	vma->vm_private_data = buf;
+
+	return 0;
+
+err_mirror:
+	dma_buf_put(buf);
 	return ret;
 }
 
+/* The seqno and metadata pages are read-only */
+static int dmapp_cdev_mmap_page(struct vm_area_struct *vma, void *page) {
+	unsigned long pfn;
+
+	if (vma_pages(vma) != 1) {
+		pr_err("dmapp_cdev_mmap: invalid range\n");
+		return -EINVAL;
+	}
+
+	if (vma->vm_flags & VM_WRITE) {
+		pr_err("dmapp_cdev_mmap: page is read-only\n");
+		return -EPERM;
+	}
+	dmapp_vm_flags_clear(vma, VM_MAYWRITE);
+
+	pfn = page_to_pfn(virt_to_page(page));
+	return remap_pfn_range(vma, vma->vm_start, pfn, PAGE_SIZE,
+		vma->vm_page_prot);
+}
+
+static int dmapp_cdev_mmap(struct file *file, struct vm_area_struct *vma) {
+	struct dmapp_user *user = file->private_data;
+	struct dmapp_device *dmapp_dev = user->dmapp_dev;
+
+	if (vma->vm_pgoff >= (DMAPP_MMAP_MIRROR >> PAGE_SHIFT)) {
+		return dmapp_cdev_mmap_mirror(dmapp_dev, vma);
+	} else if (vma->vm_pgoff == (DMAPP_MMAP_META >> PAGE_SHIFT)) {
+		return dmapp_cdev_mmap_page(vma, dmapp_dev->meta_page);
+	} else if (vma->vm_pgoff != 0) {
+		pr_err("dmapp_cdev_mmap: invalid offset\n");
+		return -EINVAL;
+	}
+
+	return dmapp_cdev_mmap_page(vma, dmapp_dev->seqno_page);
+}
+
 static const struct file_operations dmapp_cdev_fops = {
 	.owner = THIS_MODULE,
 	.open = dmapp_cdev_open,
 	.release = dmapp_cdev_release,
 	.unlocked_ioctl = dmapp_cdev_ioctl,
+	.mmap = dmapp_cdev_mmap,
 };
 
+static int dmapp_stats_show(struct seq_file *m, void *unused) {
+	struct dmapp_device *dmapp_dev = m->private;
+	struct dmapp_node_args node_args;
+	struct dmapp_wait_stats stats;
+
+	spin_lock_irq(&dmapp_dev->spinlock);
+	stats = dmapp_dev->wait_stats;
+	spin_unlock_irq(&dmapp_dev->spinlock);
+
+	seq_printf(m, "waits: %llu\n", stats.waits);
+	seq_printf(m, "timeouts: %llu\n", stats.timeouts);
+	seq_printf(m, "spin_hits: %llu\n", stats.spin_hits);
+	seq_printf(m, "spin_misses: %llu\n", stats.spin_misses);
+	seq_printf(m, "sleeps: %llu\n", stats.sleeps);
+	seq_printf(m, "avg_wait_ns: %llu\n", stats.avg_wait_ns);
+	seq_printf(m, "budget_ns: %llu\n", stats.budget_ns);
+	dmapp_buf_node(dmapp_dev, &node_args);
+	seq_printf(m, "node: %d%s\n", node_args.node,
+		(node_args.flags & DMAPP_NODE_MIXED) ? " (mixed)" : "");
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(dmapp_stats);
+
+static int dmapp_engine_show(struct seq_file *m, void *unused) {
+	static const char *names[DMAPP_JOB_PRIORITY_COUNT] = {
+		[DMAPP_JOB_PRIORITY_NORMAL] = "normal",
+		[DMAPP_JOB_PRIORITY_HIGH] = "high",
+		[DMAPP_JOB_PRIORITY_LOW] = "low",
+	};
+	struct dmapp_engine *engine = m->private;
+	struct dmapp_engine_stats stats[DMAPP_JOB_PRIORITY_COUNT];
+	unsigned long flags;
+	u64 done;
+	u32 prio;
+	int i;
+
+	spin_lock_irqsave(&engine->lock, flags);
+	memcpy(stats, engine->stats, sizeof(stats));
+	spin_unlock_irqrestore(&engine->lock, flags);
+
+	for (i = 0; i < DMAPP_JOB_PRIORITY_COUNT; ++i) {
+		prio = dmapp_job_priority_order[i];
+		done = stats[prio].completed + stats[prio].failed;
+		seq_printf(m, "%s:\n", names[prio]);
+		seq_printf(m, "  submitted: %llu\n", stats[prio].submitted);
+		seq_printf(m, "  completed: %llu\n", stats[prio].completed);
+		seq_printf(m, "  failed: %llu\n", stats[prio].failed);
+		seq_printf(m, "  blocked: %llu\n", stats[prio].blocked);
+		seq_printf(m, "  ready: %llu\n", stats[prio].ready);
+		seq_printf(m, "  avg_queue_ns: %llu\n",
+			done ? div64_u64(stats[prio].total_queue_ns, done) : 0);
+		seq_printf(m, "  avg_latency_ns: %llu\n",
+			done ? div64_u64(stats[prio].total_latency_ns, done) : 0);
+		seq_printf(m, "  max_latency_ns: %llu\n", stats[prio].max_latency_ns);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(dmapp_engine);
+
+#ifdef DMAPP_HEAP
+static int dmapp_heap_show(struct seq_file *m, void *unused) {
+	struct dmapp_heap *heap = m->private;
+	struct dmapp_heap_stats stats;
+
+	mutex_lock(&heap->lock);
+	stats = heap->stats;
+	mutex_unlock(&heap->lock);
+
+	seq_printf(m, "allocs: %llu\n", stats.allocs);
+	seq_printf(m, "pool_hits: %llu\n", stats.pool_hits);
+	seq_printf(m, "pooled: %llu\n", stats.pooled);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(dmapp_heap);
+#endif
+
+static void dmapp_latency_show(struct seq_file *m, const char *name,
+	struct dmapp_latency_stats *stats) {
+	int i;
+
+	seq_printf(m, "  %s:\n", name);
+	seq_printf(m, "    count: %llu\n", stats->count);
+	seq_printf(m, "    avg_ns: %llu\n",
+		stats->count ? div64_u64(stats->total_ns, stats->count) : 0);
+	seq_printf(m, "    max_ns: %llu\n", stats->max_ns);
+	seq_puts(m, "    hist_us:");
+	for (i = 0; i < DMAPP_LATENCY_BUCKETS; ++i) {
+		seq_printf(m, " %llu", stats->hist[i]);
+	}
+	seq_puts(m, "\n");
+}
+
+static int dmapp_signal_show(struct seq_file *m, void *unused) {
+	static const char *names[DMAPP_SIGNAL_COUNT] = {
+		"direct", "hrtimer", "tasklet", "workqueue", "kthread"
+	};
+	struct dmapp_signaler *signaler = m->private;
+	struct dmapp_signal_stats *stats;
+	u64 deadline_boosts;
+	u64 deadline_misses;
+	int mode;
+
+	stats = kmalloc_array(DMAPP_SIGNAL_COUNT, sizeof(*stats), GFP_KERNEL);
+	if (!stats) {
+		return -ENOMEM;
+	}
+
+	spin_lock_irq(&signaler->lock);
+	memcpy(stats, signaler->stats, DMAPP_SIGNAL_COUNT * sizeof(*stats));
+	deadline_boosts = signaler->deadline_boosts;
+	deadline_misses = signaler->deadline_misses;
+	spin_unlock_irq(&signaler->lock);
+
+	/* Bucket i counts latencies in [2^(i-1), 2^i) microseconds */
+	for (mode = 0; mode < DMAPP_SIGNAL_COUNT; ++mode) {
+		seq_printf(m, "%s:\n", names[mode]);
+		dmapp_latency_show(m, "irq_to_signal", &stats[mode].irq_to_signal);
+		dmapp_latency_show(m, "signal_to_wakeup",
+			&stats[mode].signal_to_wakeup);
+	}
+	seq_printf(m, "deadline_boosts: %llu\n", deadline_boosts);
+	seq_printf(m, "deadline_misses: %llu\n", deadline_misses);
+
+	kfree(stats);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(dmapp_signal);
+
 static int dmapp_platform_driver_probe(struct platform_device *pdev) {
 	struct dmapp_device *dmapp_dev;
 	int ret;
-	u64 context;
 	struct device *device;
 	struct dmapp_buffer *buffer;
-	void *vaddr;
-	dma_addr_t paddr;
-	size_t buf_size = DMAPP_BUFFER_SIZE * sizeof(int);
+	size_t buf_size = dmapp_buffer_size * sizeof(int);
+	struct dma_fence *tiles[DMAPP_TILES_MAX];
 	struct dma_buf_export_info exp_info = {
 		.exp_name = "dmapp_buffer",
 	};
@@ -349,7 +5378,7 @@ static int dmapp_platform_driver_probe(struct platform_device *pdev) {
 	cdev_init(&dmapp_dev->cdev, &dmapp_cdev_fops);
 
 	device = device_create(dmapp_class, NULL, dmapp_dev->dev, NULL, "dmapp%d",
-		MINOR(dmapp_dev->dev));
+		pdev->id);
 	if (IS_ERR(device)) {
 		ret = PTR_ERR(device);
 		pr_err("dmapp_platform_driver_probe: device_create failed\n");
@@ -359,61 +5388,85 @@ static int dmapp_platform_driver_probe(struct platform_device *pdev) {
 	dmapp_dev->device = &pdev->dev;
 
 	spin_lock_init(&dmapp_dev->spinlock);
+	INIT_LIST_HEAD(&dmapp_dev->readers);
+	init_waitqueue_head(&dmapp_dev->frame_wq);
+	init_waitqueue_head(&dmapp_dev->ring_wq);
+	mutex_init(&dmapp_dev->sub_lock);
+	idr_init(&dmapp_dev->subs);
+	dmapp_dev->size = dmapp_buffer_size;
+	atomic_set(&dmapp_dev->signals_pending, 0);
+	init_waitqueue_head(&dmapp_dev->signals_wq);
 
-	/* Create and initialize DMA fences */
-	context = dma_fence_context_alloc(1);
-	dmapp_dev->fence[0] = kzalloc(sizeof(*dmapp_dev->fence[0]),
-		GFP_KERNEL);
+	dmapp_dev->seqno_page = (struct dmapp_seqno_page *)
+		get_zeroed_page(GFP_KERNEL);
+	if (!dmapp_dev->seqno_page) {
+		ret = -ENOMEM;
+		pr_err("dmapp_platform_driver_probe: seqno page allocation failed\n");
+		goto err_seqno_page_alloc;
+	}
+
+	dmapp_dev->meta_page = (struct dmapp_meta_page *)
+		get_zeroed_page(GFP_KERNEL);
+	if (!dmapp_dev->meta_page) {
+		ret = -ENOMEM;
+		pr_err("dmapp_platform_driver_probe: meta page allocation failed\n");
+		goto err_meta_page_alloc;
+	}
+
+	/* Create and initialize DMA fences with one timeline per parity */
+	dmapp_dev->context = dma_fence_context_alloc(2);
+	dmapp_dev->fence[0] = dmapp_fence_alloc();
 	if (!dmapp_dev->fence[0]) {
 		ret = -ENOMEM;
 		pr_err("dmapp_platform_driver_probe: fence[0] allocation failed\n");
 		goto err_fence_0_alloc;
 	}
-	dma_fence_init(dmapp_dev->fence[0], &dmapp_fence_ops, &dmapp_dev->spinlock,
-		context, 0);
+	dmapp_fence_init_locked(dmapp_dev, 0, dmapp_dev->fence[0]);
 
-	dmapp_dev->fence[1] = kzalloc(sizeof(*dmapp_dev->fence[1]),
-		GFP_KERNEL);
+	dmapp_dev->fence[1] = dmapp_fence_alloc();
 	if (!dmapp_dev->fence[1]) {
 		ret = -ENOMEM;
 		pr_err("dmapp_platform_driver_probe: fence[1] allocation failed\n");
 		goto err_fence_1_alloc;
 	}
-	dma_fence_init(dmapp_dev->fence[1], &dmapp_fence_ops, &dmapp_dev->spinlock,
-		context, 1);
+	dmapp_fence_init_locked(dmapp_dev, 1, dmapp_dev->fence[1]);
+
+	/* Create the tiles of the first turn of each parity */
+	dmapp_dev->tiles = dmapp_tiles;
+	dmapp_dev->tile_context = dma_fence_context_alloc(2 * DMAPP_TILES_MAX);
+	ret = dmapp_tiles_alloc(dmapp_dev, tiles);
+	if (ret < 0) {
+		pr_err("dmapp_platform_driver_probe: tile[0] allocation failed\n");
+		goto err_tiles_0_alloc;
+	}
+	dmapp_tiles_init_locked(dmapp_dev, 0, dmapp_dev->fence[0], tiles);
+
+	ret = dmapp_tiles_alloc(dmapp_dev, tiles);
+	if (ret < 0) {
+		pr_err("dmapp_platform_driver_probe: tile[1] allocation failed\n");
+		goto err_tiles_1_alloc;
+	}
+	dmapp_tiles_init_locked(dmapp_dev, 1, dmapp_dev->fence[1], tiles);
 
 	/* Signal fence[1] immediately after initialization since the buffer is
 	 * initialized to even (0) allowing the odd pass to start
 	 */
-	ret = dma_fence_signal(dmapp_dev->fence[1]);
+	ret = dmapp_fence_signal(dmapp_dev, 1, dmapp_dev->fence[1]);
 	if (ret < 0) {
 		pr_err("dmapp_platform_driver_probe: Failed to signal fence[1]\n");
 		goto err_fence_signal;
 	}
 
 	/* Allocate and initialize buffer */
-	buffer = kzalloc(sizeof(*buffer), GFP_KERNEL);
+	buffer = dmapp_buffer_alloc(dmapp_dev->device, buf_size, NUMA_NO_NODE);
 	if (!buffer) {
 		ret = -ENOMEM;
 		goto err_alloc_buffer;
 	}
 
-	vaddr = dma_alloc_coherent(dmapp_dev->device, buf_size, &paddr, GFP_KERNEL);
-	if (!vaddr) {
-		ret = -ENOMEM;
-		/* Avoid double free if cdev_add fails */
-		kfree(buffer);
-		goto err_alloc_coherent;
-	}
-
-	buffer->vaddr = vaddr;
-	buffer->paddr = paddr;
-	buffer->size = buf_size;
-	buffer->dev = dmapp_dev->device;
-
 	/* Export DMA buffer */
 	exp_info.ops = &dmapp_dmabuf_ops;
-	exp_info.size = buf_size;
+	exp_info.size = buffer->size;
 	exp_info.flags = O_RDWR;
 	exp_info.priv = buffer;
 
@@ -422,32 +5475,55 @@ static int dmapp_platform_driver_probe(struct platform_device *pdev) {
 		ret = PTR_ERR(dmapp_dev->buf);
 		pr_err("dmapp_platform_driver_probe: dma_buf_export failed\n");
 		/* Avoid double free if cdev_add fails */
-		dma_free_coherent(dmapp_dev->device, buffer->size, buffer->vaddr,
-			buffer->paddr);
-		kfree(buffer);
+		dmapp_buffer_free(buffer);
 		goto err_dma_buf_export;
 	}
 
+	/* The device keeps its own buffer for when an import is released */
+	dmapp_dev->own_buf = dmapp_dev->buf;
+	get_dma_buf(dmapp_dev->own_buf);
+
+	ret = dma_buf_vmap_unlocked(dmapp_dev->buf, &dmapp_dev->map);
+	if (ret < 0) {
+		pr_err("dmapp_platform_driver_probe: dma_buf_vmap failed\n");
+		goto err_dma_buf_vmap;
+	}
+
 	ret = cdev_add(&dmapp_dev->cdev, dmapp_dev->dev, 1);
 	if (ret < 0) {
 		pr_err("dmapp_platform_driver_probe: cdev_add failed\n");
 		goto err_cdev_add;
 	}
 
+	/* Statistics are optional so debugfs failures are ignored */
+	dmapp_dev->debugfs = debugfs_create_dir(dev_name(device), dmapp_debugfs);
+	debugfs_create_file("stats", 0444, dmapp_dev->debugfs, dmapp_dev,
+		&dmapp_stats_fops);
+
 	pr_info("dmapp_platform_driver_probe: success\n");
 
 	return 0;
 
 err_cdev_add:
+	dma_buf_vunmap_unlocked(dmapp_dev->buf, &dmapp_dev->map);
+err_dma_buf_vmap:
+	dma_buf_put(dmapp_dev->own_buf);
 	dma_buf_put(dmapp_dev->buf);
 err_dma_buf_export:
-err_alloc_coherent:
 err_alloc_buffer:
 err_fence_signal:
+	dmapp_tiles_put(dmapp_dev, dmapp_dev->tile_fence[1]);
+err_tiles_1_alloc:
+	dmapp_tiles_put(dmapp_dev, dmapp_dev->tile_fence[0]);
+err_tiles_0_alloc:
 	dma_fence_put(dmapp_dev->fence[1]);
 err_fence_1_alloc:
 	dma_fence_put(dmapp_dev->fence[0]);
 err_fence_0_alloc:
+	free_page((unsigned long) dmapp_dev->meta_page);
+err_meta_page_alloc:
+	free_page((unsigned long) dmapp_dev->seqno_page);
+err_seqno_page_alloc:
 	device_destroy(dmapp_class, dmapp_dev->dev);
 err_device_create:
 	unregister_chrdev_region(dmapp_dev->dev, 1);
@@ -459,11 +5535,29 @@ err_alloc_chrdev:
 static int dmapp_platform_driver_remove(struct platform_device *pdev)
 {
 	struct dmapp_device *dmapp_dev = platform_get_drvdata(pdev);
+	struct dmapp_sub *sub;
+	int id;
 
+	debugfs_remove_recursive(dmapp_dev->debugfs);
 	cdev_del(&dmapp_dev->cdev);
-	dma_buf_put(dmapp_dev->buf);
+	wait_event(dmapp_dev->signals_wq,
+		atomic_read(&dmapp_dev->signals_pending) == 0);
+	idr_for_each_entry(&dmapp_dev->subs, sub, id) {
+		dmapp_sub_release(dmapp_dev, sub);
+	}
+	idr_destroy(&dmapp_dev->subs);
+	if (dmapp_dev->sub_pool) {
+		gen_pool_destroy(dmapp_dev->sub_pool);
+	}
+	dmapp_import_release(dmapp_dev->buf, dmapp_dev->import_attach,
+		dmapp_dev->import_sgt, &dmapp_dev->map);
+	dma_buf_put(dmapp_dev->own_buf);
+	dmapp_tiles_put(dmapp_dev, dmapp_dev->tile_fence[1]);
+	dmapp_tiles_put(dmapp_dev, dmapp_dev->tile_fence[0]);
 	dma_fence_put(dmapp_dev->fence[1]);
 	dma_fence_put(dmapp_dev->fence[0]);
+	free_page((unsigned long) dmapp_dev->meta_page);
+	free_page((unsigned long) dmapp_dev->seqno_page);
 	device_destroy(dmapp_class, dmapp_dev->dev);
 	unregister_chrdev_region(dmapp_dev->dev, 1);
 	kfree(dmapp_dev);
@@ -473,7 +5567,7 @@ static int dmapp_platform_driver_remove(struct platform_device *pdev)
 	return 0;
 }
 
-static struct platform_device *dmapp_platform_device;
+static struct platform_device *dmapp_platform_device[DMAPP_MAX_CHANNELS];
 
 static struct platform_driver dmapp_platform_driver = {
 	.probe  = dmapp_platform_driver_probe,
@@ -484,17 +5578,103 @@ static struct platform_driver dmapp_platform_driver = {
 	},
 };
 
+static void dmapp_platform_devices_unregister(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < dmapp_channels; ++i) {
+		if (dmapp_platform_device[i]) {
+			platform_device_unregister(dmapp_platform_device[i]);
+			dmapp_platform_device[i] = NULL;
+		}
+	}
+}
+
+#ifdef DMAPP_HEAP
+static int dmapp_heap_init(struct dmapp_heap *heap, struct device *dev)
+{
+	struct dma_heap_export_info exp_info = {
+		.name = "dmapp",
+		.ops = &dmapp_heap_ops,
+		.priv = heap,
+	};
+
+	mutex_init(&heap->lock);
+	INIT_LIST_HEAD(&heap->pool);
+	heap->dev = dev;
+
+	heap->heap = dma_heap_add(&exp_info);
+	if (IS_ERR(heap->heap)) {
+		return PTR_ERR(heap->heap);
+	}
+
+	/* dma-heaps cannot be removed so the module must stay loaded */
+	__module_get(THIS_MODULE);
+
+	debugfs_create_file("heap", 0444, dmapp_debugfs, heap, &dmapp_heap_fops);
+
+	return 0;
+}
+#endif
+
 static int __init dmapp_module_init(void)
 {
 	int ret = 0;
+	unsigned int i;
+
+	if ((dmapp_channels < 1) || (dmapp_channels > DMAPP_MAX_CHANNELS)) {
+		pr_err("dmapp_module_init: invalid channels=%u\n", dmapp_channels);
+		return -EINVAL;
+	}
+
+	if ((dmapp_tiles < 1) || (dmapp_tiles > DMAPP_TILES_MAX)) {
+		pr_err("dmapp_module_init: invalid tiles=%u\n", dmapp_tiles);
+		return -EINVAL;
+	}
+
+	if ((dmapp_buffer_size < 1) ||
+		(dmapp_buffer_size > DMAPP_BUFFER_SIZE_MAX)) {
+		pr_err("dmapp_module_init: invalid buffer_size=%u\n",
+			dmapp_buffer_size);
+		return -EINVAL;
+	}
 
-	dmapp_platform_device = platform_device_register_simple("dmapp", -1, NULL, 0);
-	if (IS_ERR(dmapp_platform_device)) {
-		pr_err("dmapp_module_init: platform_device_register_simple failed\n");
-		return PTR_ERR(dmapp_platform_device);
+	ret = dmapp_signaler_init(&dmapp_signaler);
+	if (ret < 0) {
+		pr_err("dmapp_module_init: dmapp_signaler_init failed\n");
+		return ret;
+	}
+
+	ret = dmapp_engine_init(&dmapp_engine);
+	if (ret < 0) {
+		pr_err("dmapp_module_init: dmapp_engine_init failed\n");
+		dmapp_signaler_destroy(&dmapp_signaler);
+		return ret;
+	}
+
+	dmapp_debugfs = debugfs_create_dir("dmapp", NULL);
+	debugfs_create_file("engine", 0444, dmapp_debugfs, &dmapp_engine,
+		&dmapp_engine_fops);
+	debugfs_create_file("signal", 0444, dmapp_debugfs, &dmapp_signaler,
+		&dmapp_signal_fops);
+
+	/* Register one platform device per channel */
+	for (i = 0; i < dmapp_channels; ++i) {
+		dmapp_platform_device[i] = platform_device_register_simple("dmapp", i,
+			NULL, 0);
+		if (IS_ERR(dmapp_platform_device[i])) {
+			pr_err("dmapp_module_init: platform_device_register_simple failed\n");
+			ret = PTR_ERR(dmapp_platform_device[i]);
+			dmapp_platform_device[i] = NULL;
+			goto err_platform_device_register;
+		}
 	}
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 4, 0)
 	dmapp_class = class_create(THIS_MODULE, "dmapp");
+#else
+	dmapp_class = class_create("dmapp");
+#endif
 	if (IS_ERR(dmapp_class)) {
 		pr_err("dmapp_module_init: class_create failed\n");
 		ret = PTR_ERR(dmapp_class);
@@ -507,22 +5687,53 @@ static int __init dmapp_module_init(void)
 		goto err_platform_driver_register;
 	}
 
+#ifdef DMAPP_HEAP
+	/* Heap buffers are allocated for the first channel */
+	if (dmapp_heap_enable) {
+		struct dmapp_device *dmapp_dev;
+
+		dmapp_dev = platform_get_drvdata(dmapp_platform_device[0]);
+		if (!dmapp_dev) {
+			pr_err("dmapp_module_init: no device for the heap\n");
+			ret = -ENODEV;
+			goto err_heap_init;
+		}
+
+		ret = dmapp_heap_init(&dmapp_heap, dmapp_dev->device);
+		if (ret < 0) {
+			pr_err("dmapp_module_init: dmapp_heap_init failed\n");
+			goto err_heap_init;
+		}
+	}
+#endif
+
 	pr_info("dmapp_module_init: success\n");
 
 	return 0;
 
+#ifdef DMAPP_HEAP
+err_heap_init:
+	platform_driver_unregister(&dmapp_platform_driver);
+#endif
 err_platform_driver_register:
 	class_destroy(dmapp_class);
 err_class_create:
-	platform_device_unregister(dmapp_platform_device);
+err_platform_device_register:
+	dmapp_platform_devices_unregister();
+	debugfs_remove_recursive(dmapp_debugfs);
+	dmapp_engine_destroy(&dmapp_engine);
+	dmapp_signaler_destroy(&dmapp_signaler);
 	return ret;
 }
 
 static void __exit dmapp_module_exit(void)
 {
+	dmapp_engine_destroy(&dmapp_engine);
 	platform_driver_unregister(&dmapp_platform_driver);
 	class_destroy(dmapp_class);
-	platform_device_unregister(dmapp_platform_device);
+	dmapp_platform_devices_unregister();
+	debugfs_remove_recursive(dmapp_debugfs);
+	dmapp_signaler_destroy(&dmapp_signaler);
 
 	pr_info("dmapp_module_exit: success\n");
 }
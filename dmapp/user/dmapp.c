@@ -21,16 +21,25 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <linux/dma-heap.h>
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "dmapp_block.h"
 
 #define DMAPP_SLEEP_DURATION 1000000
+#define DMAPP_TIMEOUT_NS 5000000000LL
+#define DMAPP_HUGE_SIZE (2 << 20)
 
 #define DMAPP_IOC_MAGIC 'd'
 #define DMAPP_IOCTL_GET_BUFFER_SIZE _IO(DMAPP_IOC_MAGIC, 1)
@@ -38,20 +47,893 @@
 #define DMAPP_IOCTL_GET_BUFFER_PARITY _IO(DMAPP_IOC_MAGIC, 3)
 #define DMAPP_IOCTL_BUFFER_LOCK _IO(DMAPP_IOC_MAGIC, 4)
 #define DMAPP_IOCTL_BUFFER_UNLOCK _IO(DMAPP_IOC_MAGIC, 5)
+#define DMAPP_IOCTL_BUFFER_SWAP _IO(DMAPP_IOC_MAGIC, 6)
+#define DMAPP_IOCTL_BUFFER_LOCK_TIMEOUT _IOW(DMAPP_IOC_MAGIC, 7, \
+	struct dmapp_lock_args)
+#define DMAPP_IOCTL_BUFFER_SWAP_TIMEOUT _IOW(DMAPP_IOC_MAGIC, 8, \
+	struct dmapp_lock_args)
+
+struct dmapp_lock_args {
+	int64_t timeout_ns;
+	int64_t deadline_ns;
+};
+
+#define DMAPP_IOCTL_WAIT_MULTI _IOWR(DMAPP_IOC_MAGIC, 9, \
+	struct dmapp_wait_multi_args)
+
+#define DMAPP_WAIT_MULTI_MAX 32
+#define DMAPP_WAIT_MULTI_ANY 0x1
+#define DMAPP_WAIT_MULTI_LOCK 0x2
+
+// locked reports the devices locked by the call (even when
+// the call fails) which must then be unlocked
+struct dmapp_wait_multi_args {
+	int32_t fds[DMAPP_WAIT_MULTI_MAX];
+	uint32_t count;
+	uint32_t flags;
+	int64_t timeout_ns;
+	uint32_t signaled;
+	uint32_t locked;
+};
+
+#define DMAPP_IOCTL_JOB_SUBMIT _IOWR(DMAPP_IOC_MAGIC, 10, struct dmapp_job_args)
+
+#define DMAPP_JOB_FILL 0
+#define DMAPP_JOB_COPY 1
+#define DMAPP_JOB_INCREMENT 2
+#define DMAPP_JOB_CHECKSUM 3
+
+#define DMAPP_JOB_UNLOCK 0x1
+
+#define DMAPP_JOB_PRIORITY_NORMAL 0
+#define DMAPP_JOB_PRIORITY_HIGH 1
+#define DMAPP_JOB_PRIORITY_LOW 2
+
+#define DMAPP_JOB_MAX_DEPS 8
+
+struct dmapp_job_args {
+	uint32_t op;
+	uint32_t flags;
+	int32_t src_fd;
+	uint32_t src_offset;
+	uint32_t dst_offset;
+	uint32_t count;
+	int32_t value;
+	int32_t fence_fd;
+	uint32_t priority;
+	uint32_t num_deps;
+	int32_t dep_fds[DMAPP_JOB_MAX_DEPS];
+};
+
+#define DMAPP_IOCTL_FORWARD _IOW(DMAPP_IOC_MAGIC, 11, struct dmapp_forward_args)
+
+#define DMAPP_FORWARD_OP 0x1
+#define DMAPP_FORWARD_STOP 0x2
+
+struct dmapp_forward_args {
+	uint32_t flags;
+	uint32_t op;
+	int32_t value;
+	uint32_t offset;
+	uint32_t count;
+	uint32_t pad;
+};
+
+#define DMAPP_IOCTL_TILE_UNLOCK _IOWR(DMAPP_IOC_MAGIC, 12, struct dmapp_tile_args)
+#define DMAPP_IOCTL_TILE_WAIT _IOWR(DMAPP_IOC_MAGIC, 13, struct dmapp_tile_args)
+
+struct dmapp_tile_args {
+	uint32_t tile;
+	uint32_t tiles;
+	uint32_t offset;
+	uint32_t count;
+	int64_t timeout_ns;
+};
+
+#define DMAPP_IOCTL_READ_LOCK _IOWR(DMAPP_IOC_MAGIC, 14, struct dmapp_read_args)
+#define DMAPP_IOCTL_READ_UNLOCK _IO(DMAPP_IOC_MAGIC, 15)
+
+struct dmapp_read_args {
+	int64_t timeout_ns;
+	uint64_t frame;
+};
+
+#define DMAPP_LOCK_MULTI_MAX 8
+
+#define DMAPP_IOCTL_LOCK_MULTI _IOW(DMAPP_IOC_MAGIC, 16, \
+	struct dmapp_lock_multi_args)
+
+struct dmapp_lock_multi_args {
+	int32_t fds[DMAPP_LOCK_MULTI_MAX];
+	uint32_t count;
+	uint32_t flags;
+	int64_t timeout_ns;
+};
+
+#define DMAPP_IOCTL_RING_INIT _IO(DMAPP_IOC_MAGIC, 17)
+#define DMAPP_IOCTL_RING_WAIT _IOW(DMAPP_IOC_MAGIC, 18, struct dmapp_ring_wait_args)
+#define DMAPP_IOCTL_RING_WAKE _IO(DMAPP_IOC_MAGIC, 19)
+
+#define DMAPP_RING_HEAD 0
+#define DMAPP_RING_TAIL 1
+
+struct dmapp_ring {
+	uint32_t head;
+	uint32_t head_waiting;
+	uint32_t pad0[14];
+	uint32_t tail;
+	uint32_t tail_waiting;
+	uint32_t pad1[14];
+	uint32_t size;
+	uint32_t pad2[15];
+};
+
+struct dmapp_ring_wait_args {
+	uint32_t index;
+	uint32_t value;
+	int64_t timeout_ns;
+};
+
+#define DMAPP_DAMAGE_MAX 8
+#define DMAPP_DAMAGE_ALL 0x1
+
+#define DMAPP_IOCTL_SET_DAMAGE _IOW(DMAPP_IOC_MAGIC, 20, struct dmapp_damage_args)
+#define DMAPP_IOCTL_GET_DAMAGE _IOR(DMAPP_IOC_MAGIC, 21, struct dmapp_damage_args)
+
+struct dmapp_damage_range {
+	uint32_t offset;
+	uint32_t count;
+};
+
+struct dmapp_damage_args {
+	uint32_t count;
+	uint32_t flags;
+	struct dmapp_damage_range ranges[DMAPP_DAMAGE_MAX];
+};
+
+// sets the damage of the pass and unlocks the buffer
+#define DMAPP_IOCTL_BUFFER_UNLOCK_DAMAGE _IOW(DMAPP_IOC_MAGIC, 34, \
+	struct dmapp_damage_args)
+
+#define DMAPP_IOCTL_IMPORT _IOW(DMAPP_IOC_MAGIC, 22, struct dmapp_import_args)
+
+// replaces the dmapp buffer with a foreign dma-buf
+// (or restores the dmapp buffer when fd is negative)
+struct dmapp_import_args {
+	int32_t fd;
+	uint32_t flags;
+};
+
+#define DMAPP_IOCTL_USERPTR _IOW(DMAPP_IOC_MAGIC, 23, struct dmapp_userptr_args)
+
+// pins and imports a page aligned range of user memory
+struct dmapp_userptr_args {
+	uint64_t addr;
+	uint64_t size;
+	uint32_t flags;
+	uint32_t pad;
+};
+
+#define DMAPP_IOCTL_MEMFD _IOW(DMAPP_IOC_MAGIC, 24, struct dmapp_memfd_args)
+
+// imports a range of a memfd sealed against shrinking
+struct dmapp_memfd_args {
+	int32_t memfd;
+	uint32_t flags;
+	uint64_t offset;
+	uint64_t size;
+};
+
+#define DMAPP_IOCTL_SET_NODE _IOW(DMAPP_IOC_MAGIC, 25, struct dmapp_node_args)
+#define DMAPP_IOCTL_GET_NODE _IOR(DMAPP_IOC_MAGIC, 26, struct dmapp_node_args)
+
+// the pages of the buffer span several nodes
+#define DMAPP_NODE_MIXED 0x1
+
+// NUMA node of the buffer where a negative node places the
+// buffer near the caller (or reports an unknown node) and
+// SET_NODE discards the frame and any imported buffer
+struct dmapp_node_args {
+	int32_t node;
+	uint32_t flags;
+};
+
+#define DMAPP_IOCTL_SUB_ALLOC _IOWR(DMAPP_IOC_MAGIC, 27, struct dmapp_sub_args)
+#define DMAPP_IOCTL_SUB_FREE _IOW(DMAPP_IOC_MAGIC, 28, struct dmapp_sub_args)
+#define DMAPP_IOCTL_SUB_SIGNAL _IOWR(DMAPP_IOC_MAGIC, 29, struct dmapp_sub_args)
+#define DMAPP_IOCTL_SUB_WAIT _IOWR(DMAPP_IOC_MAGIC, 30, struct dmapp_sub_args)
+
+// a small buffer at offset within the dmapp buffer with its
+// own fence timeline
+struct dmapp_sub_args {
+	uint32_t handle;
+	uint32_t offset;
+	uint32_t size;
+	uint32_t flags;
+	uint64_t seqno;
+	int64_t timeout_ns;
+};
+
+#define DMAPP_IOCTL_SET_LAYOUT _IOWR(DMAPP_IOC_MAGIC, 31, struct dmapp_layout_args)
+#define DMAPP_IOCTL_GET_LAYOUT _IOR(DMAPP_IOC_MAGIC, 32, struct dmapp_layout_args)
+
+#define DMAPP_PLANES_MAX 4
+#define DMAPP_BLOCK_BENCH_COUNT 100
+
+// planes are stored as 64x64 byte blocks (see dmapp_block.h)
+#define DMAPP_LAYOUT_BLOCKED 0x1
+
+// DRM fourcc formats
+#define DMAPP_FOURCC(a, b, c, d) \
+	((uint32_t) (a) | ((uint32_t) (b) << 8) | \
+	 ((uint32_t) (c) << 16) | ((uint32_t) (d) << 24))
+#define DMAPP_FORMAT_R8       DMAPP_FOURCC('R', '8', ' ', ' ')
+#define DMAPP_FORMAT_XRGB8888 DMAPP_FOURCC('X', 'R', '2', '4')
+#define DMAPP_FORMAT_NV12     DMAPP_FOURCC('N', 'V', '1', '2')
+
+struct dmapp_plane {
+	uint32_t offset;
+	uint32_t stride;
+};
+
+// image layout of the buffer where the kernel computes
+// aligned planes when num_planes is zero
+struct dmapp_layout_args {
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint32_t flags;
+	uint32_t align;
+	uint32_t num_planes;
+	uint32_t size;
+	uint32_t pad;
+	struct dmapp_plane planes[DMAPP_PLANES_MAX];
+};
+
+#define DMAPP_IOCTL_BUFFER_UNLOCK_META _IOW(DMAPP_IOC_MAGIC, 33, \
+	struct dmapp_meta_args)
+
+#define DMAPP_META_DATA_SIZE 40
+
+// application defined flag which lets consumers skip a
+// frame without touching the payload
+#define DMAPP_META_FLAG_SKIP 0x1
+
+// per-frame record published on unlock where the kernel
+// fills in the frame (and a zero timestamp)
+struct dmapp_meta_args {
+	uint64_t frame;
+	uint64_t timestamp_ns;
+	uint32_t flags;
+	uint32_t size;
+	uint8_t  data[DMAPP_META_DATA_SIZE];
+};
+
+// read-only metadata page with a record per parity
+#define DMAPP_MMAP_META 0x20000000
+
+struct dmapp_meta_page {
+	struct dmapp_meta_args meta[2];
+};
+
+// maps the buffer twice back-to-back
+#define DMAPP_MMAP_MIRROR 0x40000000
+
+// read-only page mapped at offset 0 of the dmapp device
+struct dmapp_seqno_page {
+	uint64_t signaled[2];
+	uint64_t pending[2];
+};
+
+// check if our turn has come without entering the kernel
+static int dmapp_turn_ready(struct dmapp_seqno_page* seqno_page, int parity) {
+	uint64_t pending = __atomic_load_n(&seqno_page->pending[parity],
+		__ATOMIC_ACQUIRE);
+	uint64_t signaled = __atomic_load_n(&seqno_page->signaled[parity],
+		__ATOMIC_ACQUIRE);
+	return signaled >= pending;
+}
+
+static int64_t dmapp_time_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return 1000000000LL * ts.tv_sec + ts.tv_nsec;
+}
+
+// sleep until the peer moves index away from value where the
+// waiting flag is raised before the final check so that the
+// peer cannot miss the doorbell
+static int dmapp_ring_wait(int fd, uint32_t which, uint32_t* index,
+                           uint32_t* waiting, uint32_t value) {
+	int ret = 0;
+
+	__atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(index, __ATOMIC_SEQ_CST) == value) {
+		struct dmapp_ring_wait_args wait_args = {
+			.index = which,
+			.value = value,
+			.timeout_ns = DMAPP_TIMEOUT_NS,
+		};
+		ret = ioctl(fd, DMAPP_IOCTL_RING_WAIT, &wait_args);
+	}
+	__atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+	return ret;
+}
+
+// publish index and ring the doorbell only if the peer sleeps
+static void dmapp_ring_publish(int fd, uint32_t* index,
+                               uint32_t* peer_waiting, uint32_t value) {
+	__atomic_store_n(index, value, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(peer_waiting, __ATOMIC_RELAXED)) {
+		ioctl(fd, DMAPP_IOCTL_RING_WAKE);
+	}
+}
+
+// the data is either mirrored (contiguous for any record up
+// to the ring size) or must be split at the end of the ring
+static void dmapp_ring_write(int fd, struct dmapp_ring* ring,
+                             uint8_t* data, int mirrored,
+                             const void* src, uint32_t n) {
+	uint32_t head = ring->head;
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	while (ring->size - (head - tail) < n) {
+		dmapp_ring_wait(fd, DMAPP_RING_TAIL, &ring->tail,
+		                &ring->tail_waiting, tail);
+		tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	}
+
+	uint32_t offset = head & (ring->size - 1);
+	uint32_t first = ring->size - offset;
+	if (mirrored || (first > n)) {
+		first = n;
+	}
+	memcpy(data + offset, src, first);
+	memcpy(data, (const uint8_t*) src + first, n - first);
+
+	dmapp_ring_publish(fd, &ring->head, &ring->head_waiting, head + n);
+}
+
+static void dmapp_ring_read(int fd, struct dmapp_ring* ring,
+                            uint8_t* data, int mirrored,
+                            void* dst, uint32_t n) {
+	uint32_t tail = ring->tail;
+	uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	while (head - tail < n) {
+		dmapp_ring_wait(fd, DMAPP_RING_HEAD, &ring->head,
+		                &ring->head_waiting, head);
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	}
+
+	uint32_t offset = tail & (ring->size - 1);
+	uint32_t first = ring->size - offset;
+	if (mirrored || (first > n)) {
+		first = n;
+	}
+	memcpy(dst, data + offset, first);
+	memcpy((uint8_t*) dst + first, data, n - first);
+
+	dmapp_ring_publish(fd, &ring->tail, &ring->tail_waiting, tail + n);
+}
+
+// print each tile of our next turn as soon as the peer has
+// written it where tiles is updated to the kernel's count
+static void dmapp_tiles_read(int fd, const int* buf, int parity,
+                             uint32_t* tiles) {
+	struct dmapp_tile_args tile_args = {
+		.timeout_ns = DMAPP_TIMEOUT_NS,
+	};
+	uint32_t i;
+	for (tile_args.tile = 0; tile_args.tile < *tiles; ++tile_args.tile) {
+		if (ioctl(fd, DMAPP_IOCTL_TILE_WAIT, &tile_args) == -1) {
+			printf("dmapp: DMAPP_IOCTL_TILE_WAIT failed: %s\n",
+			       strerror(errno));
+			return;
+		}
+		*tiles = tile_args.tiles;
+
+		printf("tile(%i): %u/%u ", 1 - parity, tile_args.tile,
+		       tile_args.tiles);
+		for (i = 0; i < tile_args.count; ++i) {
+			printf("%i", buf[tile_args.offset + i]);
+		}
+		printf("\n");
+	}
+}
+
+// increment the buffer a tile at a time and hand each tile
+// to the peer once it has been written
+static void dmapp_tiles_write(int fd, int* buf, uint32_t size,
+                              uint32_t tiles) {
+	struct dmapp_tile_args tile_args;
+	uint32_t i;
+	for (tile_args.tile = 0; tile_args.tile < tiles; ++tile_args.tile) {
+		uint32_t begin = tile_args.tile * size / tiles;
+		uint32_t end   = (tile_args.tile + 1) * size / tiles;
+		for (i = begin; i < end; ++i) {
+			++buf[i];
+		}
+		usleep(DMAPP_SLEEP_DURATION / tiles);
+
+		if (ioctl(fd, DMAPP_IOCTL_TILE_UNLOCK, &tile_args) == -1) {
+			printf("dmapp: DMAPP_IOCTL_TILE_UNLOCK failed\n");
+			return;
+		}
+	}
+}
+
+// allocate the buffer from a dma-heap and share it
+// through the dmapp device in place of the dmapp buffer
+static int dmapp_import_heap(int fd, size_t len) {
+	struct dma_heap_allocation_data alloc_data = {
+		.len = len,
+		.fd_flags = O_RDWR | O_CLOEXEC,
+	};
+	int ret;
+
+	// prefer the pooled dmapp heap when it is registered
+	int heap_fd = open("/dev/dma_heap/dmapp", O_RDONLY | O_CLOEXEC);
+	if (heap_fd < 0) {
+		heap_fd = open("/dev/dma_heap/system", O_RDONLY | O_CLOEXEC);
+	}
+	if (heap_fd < 0) {
+		printf("dmapp: open dma_heap failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	ret = ioctl(heap_fd, DMA_HEAP_IOCTL_ALLOC, &alloc_data);
+	close(heap_fd);
+	if (ret == -1) {
+		printf("dmapp: DMA_HEAP_IOCTL_ALLOC failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	// the dmapp device holds its own reference to the dma-buf
+	struct dmapp_import_args import_args = {
+		.fd = alloc_data.fd,
+	};
+	ret = ioctl(fd, DMAPP_IOCTL_IMPORT, &import_args);
+	if (ret == -1) {
+		printf("dmapp: DMAPP_IOCTL_IMPORT failed: %s\n", strerror(errno));
+	}
+	close(alloc_data.fd);
+
+	return ret;
+}
+
+// share an existing allocation through the dmapp device
+// without copying it into the dmapp buffer
+static int dmapp_import_userptr(int fd, size_t len) {
+	// the pages stay pinned by the dma-buf so the
+	// allocation must outlive the pipeline
+	void* addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED) {
+		printf("dmapp: mmap userptr failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	struct dmapp_userptr_args userptr_args = {
+		.addr = (uint64_t) (uintptr_t) addr,
+		.size = len,
+	};
+	int ret = ioctl(fd, DMAPP_IOCTL_USERPTR, &userptr_args);
+	if (ret == -1) {
+		printf("dmapp: DMAPP_IOCTL_USERPTR failed: %s\n", strerror(errno));
+		munmap(addr, len);
+	}
+
+	return ret;
+}
+
+// share the frames as ordinary shared memory which tools
+// may open through /proc/<pid>/fd/<memfd>
+static int dmapp_import_memfd(int fd, size_t len) {
+	int ret = -1;
+
+	int memfd = memfd_create("dmapp", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd < 0) {
+		printf("dmapp: memfd_create failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if ((ftruncate(memfd, len) == -1) ||
+	    (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) == -1)) {
+		printf("dmapp: memfd setup failed: %s\n", strerror(errno));
+		goto fail_memfd;
+	}
+
+	// the dma-buf holds its own reference to the memfd
+	struct dmapp_memfd_args memfd_args = {
+		.memfd = memfd,
+		.size = len,
+	};
+	ret = ioctl(fd, DMAPP_IOCTL_MEMFD, &memfd_args);
+	if (ret == -1) {
+		printf("dmapp: DMAPP_IOCTL_MEMFD failed: %s\n", strerror(errno));
+	}
+
+	fail_memfd:
+		close(memfd);
+	return ret;
+}
+
+// place large buffers at a 2MB aligned address so that the
+// kernel may map whole huge pages with PMD entries
+static void* dmapp_mmap_buffer(size_t len, int prot, int fd) {
+	if (len < DMAPP_HUGE_SIZE) {
+		return mmap(NULL, len, prot, MAP_SHARED, fd, 0);
+	}
+
+	size_t reserve_len = len + DMAPP_HUGE_SIZE;
+	void* reserve = mmap(NULL, reserve_len, PROT_NONE,
+	                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (reserve == MAP_FAILED) {
+		return MAP_FAILED;
+	}
+
+	uintptr_t start = (uintptr_t) reserve;
+	uintptr_t addr  = (start + DMAPP_HUGE_SIZE - 1) &
+	                  ~((uintptr_t) DMAPP_HUGE_SIZE - 1);
+	void* buf = mmap((void*) addr, len, prot, MAP_SHARED | MAP_FIXED,
+	                 fd, 0);
+	if (buf == MAP_FAILED) {
+		munmap(reserve, reserve_len);
+		return MAP_FAILED;
+	}
+
+	// release the unused head and tail of the reservation
+	if (addr > start) {
+		munmap(reserve, addr - start);
+	}
+	if (start + reserve_len > addr + len) {
+		munmap((void*) (addr + len), start + reserve_len - (addr + len));
+	}
+
+	return buf;
+}
+
+// a dmapp device opened by a stage which consumes several
+// channels
+struct dmapp_channel {
+	int fd;
+	int size;
+	int dma_buf_fd;
+	int* buf;
+};
+
+static void dmapp_channels_close(struct dmapp_channel* channels,
+                                 int count) {
+	int i;
+	for (i = 0; i < count; ++i) {
+		if (channels[i].buf != MAP_FAILED) {
+			munmap(channels[i].buf, channels[i].size * sizeof(int));
+		}
+		if (channels[i].dma_buf_fd >= 0) {
+			close(channels[i].dma_buf_fd);
+		}
+		if (channels[i].fd >= 0) {
+			close(channels[i].fd);
+		}
+	}
+}
+
+static int dmapp_channels_open(struct dmapp_channel* channels,
+                               int count, char** dev_names) {
+	int i;
+	for (i = 0; i < count; ++i) {
+		channels[i].fd = -1;
+		channels[i].dma_buf_fd = -1;
+		channels[i].buf = MAP_FAILED;
+	}
+
+	for (i = 0; i < count; ++i) {
+		struct dmapp_channel* channel = &channels[i];
+		channel->fd = open(dev_names[i], O_RDWR);
+		if (channel->fd < 0) {
+			printf("dmapp: open %s failed\n", dev_names[i]);
+			goto fail_channel;
+		}
+
+		channel->size = ioctl(channel->fd, DMAPP_IOCTL_GET_BUFFER_SIZE);
+		channel->dma_buf_fd = ioctl(channel->fd, DMAPP_IOCTL_GET_BUFFER_FD);
+		if ((channel->size <= 0) || (channel->dma_buf_fd < 0)) {
+			printf("dmapp: %s has no buffer\n", dev_names[i]);
+			goto fail_channel;
+		}
+
+		channel->buf = mmap(NULL, channel->size * sizeof(int),
+		                    PROT_READ | PROT_WRITE, MAP_SHARED,
+		                    channel->dma_buf_fd, 0);
+		if (channel->buf == MAP_FAILED) {
+			printf("dmapp: mmap failed: %s\n", strerror(errno));
+			goto fail_channel;
+		}
+	}
+
+	return 0;
+
+	fail_channel:
+		dmapp_channels_close(channels, count);
+	return -1;
+}
+
+// increment a channel buffer and hand it back to its peer
+static void dmapp_channel_process(struct dmapp_channel* channel,
+                                  const char* name) {
+	int i;
+
+	printf("%s: ", name);
+	for (i = 0; i < channel->size; ++i) {
+		printf("%i", channel->buf[i]++);
+	}
+	printf("\n");
+
+	if (ioctl(channel->fd, DMAPP_IOCTL_BUFFER_UNLOCK) == -1) {
+		printf("dmapp: DMAPP_IOCTL_BUFFER_UNLOCK failed\n");
+	}
+}
+
+// process the channels in the order that their peers hand
+// them over with a single wait for any of them
+static int dmapp_merge(int count, char** dev_names) {
+	struct dmapp_channel channels[DMAPP_WAIT_MULTI_MAX];
+	int i;
+
+	if (count > DMAPP_WAIT_MULTI_MAX) {
+		printf("dmapp: too many channels\n");
+		return EXIT_FAILURE;
+	}
+
+	if (dmapp_channels_open(channels, count, dev_names) == -1) {
+		return EXIT_FAILURE;
+	}
+
+	struct dmapp_wait_multi_args wait_args = {
+		.count = count,
+		.flags = DMAPP_WAIT_MULTI_ANY | DMAPP_WAIT_MULTI_LOCK,
+		.timeout_ns = DMAPP_TIMEOUT_NS,
+	};
+	for (i = 0; i < count; ++i) {
+		wait_args.fds[i] = channels[i].fd;
+	}
+
+	while (1) {
+		int ret = ioctl(channels[0].fd, DMAPP_IOCTL_WAIT_MULTI, &wait_args);
+		if ((ret == -1) && (errno != ETIMEDOUT)) {
+			printf("dmapp: DMAPP_IOCTL_WAIT_MULTI failed: %s\n",
+			       strerror(errno));
+			usleep(DMAPP_SLEEP_DURATION);
+		}
+
+		// the channels which were locked are released even
+		// when locking another channel failed
+		for (i = 0; i < count; ++i) {
+			if (wait_args.locked & (1U << i)) {
+				dmapp_channel_process(&channels[i], dev_names[i]);
+			}
+		}
+	}
+
+	dmapp_channels_close(channels, count);
+	return EXIT_SUCCESS;
+}
+
+// process the channels together once all of their peers
+// have handed them over
+static int dmapp_join(int count, char** dev_names) {
+	struct dmapp_channel channels[DMAPP_LOCK_MULTI_MAX];
+	int i;
+
+	if (count > DMAPP_LOCK_MULTI_MAX) {
+		printf("dmapp: too many channels\n");
+		return EXIT_FAILURE;
+	}
+
+	if (dmapp_channels_open(channels, count, dev_names) == -1) {
+		return EXIT_FAILURE;
+	}
+
+	struct dmapp_lock_multi_args lock_args = {
+		.count = count,
+		.timeout_ns = DMAPP_TIMEOUT_NS,
+	};
+	for (i = 0; i < count; ++i) {
+		lock_args.fds[i] = channels[i].fd;
+	}
+
+	while (1) {
+		// either all of the channels are locked or none are
+		int ret = ioctl(channels[0].fd, DMAPP_IOCTL_LOCK_MULTI, &lock_args);
+		if ((ret == -1) && (errno == ETIMEDOUT)) {
+			continue;
+		} else if (ret == -1) {
+			printf("dmapp: DMAPP_IOCTL_LOCK_MULTI failed: %s\n",
+			       strerror(errno));
+			usleep(DMAPP_SLEEP_DURATION);
+			continue;
+		}
+
+		for (i = 0; i < count; ++i) {
+			dmapp_channel_process(&channels[i], dev_names[i]);
+		}
+	}
+
+	dmapp_channels_close(channels, count);
+	return EXIT_SUCCESS;
+}
+
+// filter a random frame and sum its columns in the linear
+// and blocked layouts and publish the blocked result in buf
+static int dmapp_block_bench(uint8_t* buf,
+                             const struct dmapp_layout_args* layout) {
+	uint32_t width  = layout->width;
+	uint32_t height = layout->height;
+	uint32_t stride = layout->planes[0].stride;
+	size_t   size   = dmapp_block_size(stride, height);
+	int      ret    = -1;
+	size_t   i;
+
+	uint8_t* src  = aligned_alloc(DMAPP_BLOCK_SIZE, size);
+	uint8_t* dst  = aligned_alloc(DMAPP_BLOCK_SIZE, size);
+	uint8_t* tsrc = aligned_alloc(DMAPP_BLOCK_SIZE, size);
+	uint8_t* tdst = aligned_alloc(DMAPP_BLOCK_SIZE, size);
+	uint32_t* sums  = calloc(width, sizeof(uint32_t));
+	uint32_t* tsums = calloc(width, sizeof(uint32_t));
+	if ((src == NULL) || (dst == NULL) || (tsrc == NULL) ||
+	    (tdst == NULL) || (sums == NULL) || (tsums == NULL)) {
+		printf("dmapp: block bench alloc failed\n");
+		goto fail_alloc;
+	}
+
+	for (i = 0; i < size; ++i) {
+		src[i] = rand();
+	}
+	memcpy(dst, src, size);
+	dmapp_block_from_linear(tsrc, stride, src, stride, width, height);
+	memcpy(tdst, tsrc, size);
+
+	int64_t t0 = dmapp_time_ns();
+	for (i = 0; i < DMAPP_BLOCK_BENCH_COUNT; ++i) {
+		dmapp_block_filter3x3_linear(dst, src, stride, width, height);
+	}
+	int64_t t1 = dmapp_time_ns();
+	for (i = 0; i < DMAPP_BLOCK_BENCH_COUNT; ++i) {
+		dmapp_block_filter3x3_blocked(tdst, tsrc, stride, width, height);
+	}
+	int64_t t2 = dmapp_time_ns();
+	for (i = 0; i < DMAPP_BLOCK_BENCH_COUNT; ++i) {
+		dmapp_block_column_sum_linear(sums, src, stride, width, height);
+	}
+	int64_t t3 = dmapp_time_ns();
+	for (i = 0; i < DMAPP_BLOCK_BENCH_COUNT; ++i) {
+		dmapp_block_column_sum_blocked(tsums, tsrc, stride, width, height);
+	}
+	int64_t t4 = dmapp_time_ns();
+
+	// both layouts must produce the same results
+	if (memcmp(sums, tsums, width * sizeof(uint32_t))) {
+		printf("dmapp: block bench column sum mismatch\n");
+		goto fail_alloc;
+	}
+	dmapp_block_to_linear(src, stride, tdst, stride, width, height);
+	for (i = 0; i < height; ++i) {
+		if (memcmp(src + i * stride, dst + i * stride, width)) {
+			printf("dmapp: block bench mismatch at row=%zu\n", i);
+			goto fail_alloc;
+		}
+	}
+
+	printf("dmapp: 3x3 %ux%u linear=%lluus blocked=%lluus\n",
+	       width, height,
+	       (unsigned long long) (t1 - t0) / DMAPP_BLOCK_BENCH_COUNT / 1000,
+	       (unsigned long long) (t2 - t1) / DMAPP_BLOCK_BENCH_COUNT / 1000);
+	printf("dmapp: columns %ux%u linear=%lluus blocked=%lluus\n",
+	       width, height,
+	       (unsigned long long) (t3 - t2) / DMAPP_BLOCK_BENCH_COUNT / 1000,
+	       (unsigned long long) (t4 - t3) / DMAPP_BLOCK_BENCH_COUNT / 1000);
+
+	memcpy(buf, tdst, size);
+	ret = 0;
+
+	fail_alloc:
+		free(tsums);
+		free(sums);
+		free(tdst);
+		free(tsrc);
+		free(dst);
+		free(src);
+	return ret;
+}
 
 int main(int argc, char** argv) {
 	int* buf;
+	struct dmapp_seqno_page* seqno_page;
+	struct dmapp_meta_page* meta_page;
 	int dma_buf_fd;
 	int size_bytes;
 
-	if(argc != 2) {
-		printf("usage: %s dev_name\n", argv[0]);
+	// the merge and join modes consume dev_name and the
+	// following devices
+	int use_merge = (argc >= 4) && (strcmp(argv[2], "merge") == 0);
+	int use_join  = (argc >= 4) && (strcmp(argv[2], "join") == 0);
+
+	if((argc != 2) && !use_merge && !use_join && !((argc == 3) &&
+	   ((strcmp(argv[2], "engine") == 0) ||
+	    (strcmp(argv[2], "relay") == 0) ||
+	    (strcmp(argv[2], "reader") == 0) ||
+	    (strcmp(argv[2], "stream") == 0) ||
+	    (strcmp(argv[2], "heap") == 0) ||
+	    (strcmp(argv[2], "userptr") == 0) ||
+	    (strcmp(argv[2], "memfd") == 0) ||
+	    (strcmp(argv[2], "numa") == 0) ||
+	    (strcmp(argv[2], "sub") == 0) ||
+	    (strcmp(argv[2], "layout") == 0) ||
+	    (strcmp(argv[2], "block") == 0) ||
+	    (strcmp(argv[2], "meta") == 0) ||
+	    (strcmp(argv[2], "damage") == 0) ||
+	    (strcmp(argv[2], "tiles") == 0)))) {
+		printf("usage: %s dev_name "
+		       "[engine|relay|reader|stream|heap|userptr|memfd|numa|sub|"
+		       "layout|block|meta|damage|tiles]\n"
+		       "       %s dev_name [merge|join] dev_name ...\n",
+		       argv[0], argv[0]);
 		return EXIT_FAILURE;
 	}
 
+	if (use_merge || use_join) {
+		argv[2] = argv[1];
+		return use_merge ? dmapp_merge(argc - 2, &argv[2]) :
+		                   dmapp_join(argc - 2, &argv[2]);
+	}
+
 	char* dev_name = argv[1];
 
-	int fd = open(dev_name, O_RDWR);
+	// optionally offload the work to the kernel engine or
+	// forward the buffer entirely in the kernel
+	int use_engine = (argc == 3) && (strcmp(argv[2], "engine") == 0);
+	int use_relay  = (argc == 3) && (strcmp(argv[2], "relay") == 0);
+
+	// read-only users share each frame with the other readers
+	int use_reader = (argc == 3) && (strcmp(argv[2], "reader") == 0);
+
+	// stream messages through a lock-free ring in the buffer
+	int use_stream = (argc == 3) && (strcmp(argv[2], "stream") == 0);
+
+	// share a buffer allocated from the system dma-heap
+	int use_heap = (argc == 3) && (strcmp(argv[2], "heap") == 0);
+
+	// share user memory pinned by the kernel
+	int use_userptr = (argc == 3) && (strcmp(argv[2], "userptr") == 0);
+
+	// share a sealed memfd with tools that expect shared memory
+	int use_memfd = (argc == 3) && (strcmp(argv[2], "memfd") == 0);
+
+	// move the buffer to the NUMA node of the first user
+	int use_numa = (argc == 3) && (strcmp(argv[2], "numa") == 0);
+
+	// publish a counter in a small suballocation of the buffer
+	int use_sub = (argc == 3) && (strcmp(argv[2], "sub") == 0);
+
+	// describe the buffer as an NV12 frame and report the planes
+	int use_layout = (argc == 3) && (strcmp(argv[2], "layout") == 0);
+
+	// compare a 3x3 filter of a linear and a blocked frame
+	int use_block = (argc == 3) && (strcmp(argv[2], "block") == 0);
+
+	// publish a record with each frame and skip every other
+	// frame without touching the payload
+	int use_meta = (argc == 3) && (strcmp(argv[2], "meta") == 0);
+
+	// change a single int per pass and report the ranges
+	// which the peer changed since our previous pass
+	int use_damage = (argc == 3) && (strcmp(argv[2], "damage") == 0);
+
+	// read each tile while the peer is still writing the rest
+	// of the buffer (see the tiles module parameter)
+	int use_tiles = (argc == 3) && (strcmp(argv[2], "tiles") == 0);
+
+	int fd = open(dev_name, use_reader ? O_RDONLY : O_RDWR);
 	if (fd < 0) {
 		printf("dmapp: open %s failed\n", dev_name);
 		return EXIT_FAILURE;
@@ -64,12 +946,104 @@ int main(int argc, char** argv) {
 	}
 	size_bytes = size * sizeof(int);
 
-	int parity = ioctl(fd, DMAPP_IOCTL_GET_BUFFER_PARITY);
+	int parity = use_reader ? 0 : ioctl(fd, DMAPP_IOCTL_GET_BUFFER_PARITY);
 	if ((parity < 0) || (parity > 1)) {
 		printf("dmapp: invalid parity=%i\n", parity);
 		goto fail_parity;
 	}
 
+	// the first user imports the buffer for both users
+	if ((use_heap || use_userptr || use_memfd) && (parity == 0)) {
+		long page_size = sysconf(_SC_PAGESIZE);
+		size_t len = (size_bytes + page_size - 1) & ~(page_size - 1);
+		if (use_heap) {
+			size = dmapp_import_heap(fd, len);
+		} else if (use_userptr) {
+			size = dmapp_import_userptr(fd, len);
+		} else {
+			size = dmapp_import_memfd(fd, len);
+		}
+		if (size <= 0) {
+			goto fail_parity;
+		}
+		size_bytes = size * sizeof(int);
+	}
+
+	struct dmapp_node_args node_args = {
+		.node = -1,
+	};
+	if (use_numa && (parity == 0) &&
+	    (ioctl(fd, DMAPP_IOCTL_SET_NODE, &node_args) == -1)) {
+		printf("dmapp: DMAPP_IOCTL_SET_NODE failed: %s\n", strerror(errno));
+		goto fail_parity;
+	}
+
+	// report the node so that stages may be placed near it
+	if (ioctl(fd, DMAPP_IOCTL_GET_NODE, &node_args) == 0) {
+		printf("dmapp: buffer node=%i%s\n", node_args.node,
+		       (node_args.flags & DMAPP_NODE_MIXED) ? " (mixed)" : "");
+	}
+
+	if (use_layout || use_block) {
+		struct dmapp_layout_args layout_args = {
+			.width = 640,
+			.height = 480,
+			.format = DMAPP_FORMAT_NV12,
+		};
+		if (use_block) {
+			layout_args.width  = 1920;
+			layout_args.height = 1080;
+			layout_args.format = DMAPP_FORMAT_R8;
+			layout_args.flags  = DMAPP_LAYOUT_BLOCKED;
+		}
+		if ((parity == 0) &&
+		    (ioctl(fd, DMAPP_IOCTL_SET_LAYOUT, &layout_args) == -1)) {
+			printf("dmapp: DMAPP_IOCTL_SET_LAYOUT failed: %s\n",
+			       strerror(errno));
+			goto fail_parity;
+		}
+
+		if (ioctl(fd, DMAPP_IOCTL_GET_LAYOUT, &layout_args) == -1) {
+			printf("dmapp: DMAPP_IOCTL_GET_LAYOUT failed: %s\n",
+			       strerror(errno));
+			goto fail_parity;
+		}
+
+		printf("dmapp: layout %ux%u format=0x%x size=%u\n",
+		       layout_args.width, layout_args.height,
+		       layout_args.format, layout_args.size);
+		uint32_t plane;
+		for (plane = 0; plane < layout_args.num_planes; ++plane) {
+			printf("dmapp: plane%u offset=%u stride=%u\n", plane,
+			       layout_args.planes[plane].offset,
+			       layout_args.planes[plane].stride);
+		}
+
+		if (use_block && (parity == 0)) {
+			dma_buf_fd = ioctl(fd, DMAPP_IOCTL_GET_BUFFER_FD);
+			if (dma_buf_fd < 0) {
+				printf("dmapp: failed to get DMA buffer FD\n");
+				goto fail_dma_buf_fd;
+			}
+
+			buf = mmap(NULL, layout_args.size, PROT_READ | PROT_WRITE,
+			           MAP_SHARED, dma_buf_fd, 0);
+			if (buf == MAP_FAILED) {
+				printf("dmapp: mmap failed: %s\n", strerror(errno));
+				goto fail_mmap;
+			}
+
+			if (dmapp_block_bench((uint8_t*) buf, &layout_args) == 0) {
+				printf("dmapp: published blocked frame\n");
+			}
+			munmap(buf, layout_args.size);
+			close(dma_buf_fd);
+		}
+
+		close(fd);
+		return EXIT_SUCCESS;
+	}
+
 	// Get the DMA buffer file descriptor
 	dma_buf_fd = ioctl(fd, DMAPP_IOCTL_GET_BUFFER_FD);
 	if (dma_buf_fd < 0) {
@@ -77,24 +1051,268 @@ int main(int argc, char** argv) {
 		goto fail_dma_buf_fd;
 	}
 
+	// the ring spans the whole (page aligned) DMA buffer
+	if (use_stream) {
+		size_bytes = lseek(dma_buf_fd, 0, SEEK_END);
+	}
+
 	// Map the DMA buffer
-	buf = mmap(NULL, size_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, dma_buf_fd, 0);
+	int prot = use_reader ? PROT_READ : (PROT_READ | PROT_WRITE);
+	buf = dmapp_mmap_buffer(size_bytes, prot, dma_buf_fd);
 	if (buf == MAP_FAILED) {
 		printf("dmapp: mmap failed: %s\n", strerror(errno));
 		goto fail_mmap;
 	}
 
+	// Map the seqno page
+	seqno_page = mmap(NULL, sizeof(struct dmapp_seqno_page), PROT_READ,
+		MAP_SHARED, fd, 0);
+	if (seqno_page == MAP_FAILED) {
+		printf("dmapp: mmap seqno page failed: %s\n", strerror(errno));
+		goto fail_mmap_seqno_page;
+	}
+
+	// Map the metadata page
+	meta_page = mmap(NULL, sizeof(struct dmapp_meta_page), PROT_READ,
+		MAP_SHARED, fd, DMAPP_MMAP_META);
+	if (meta_page == MAP_FAILED) {
+		printf("dmapp: mmap meta page failed: %s\n", strerror(errno));
+		goto fail_mmap_meta_page;
+	}
+
 	int ret;
 	int i;
-	while (1) {
-		// lock buffer
+
+	// the kernel increments and forwards the buffer on each
+	// turn so there is nothing left to do but monitor it
+	if (use_relay) {
+		struct dmapp_forward_args forward_args = {
+			.flags = DMAPP_FORWARD_OP,
+			.op = DMAPP_JOB_INCREMENT,
+			.value = 1,
+		};
+		ret = ioctl(fd, DMAPP_IOCTL_FORWARD, &forward_args);
+		if (ret == -1) {
+			printf("dmapp: DMAPP_IOCTL_FORWARD failed: %s\n",
+			       strerror(errno));
+			goto fail_forward;
+		}
+
+		while (1) {
+			printf("relay(%i): seqno=%llu\n", parity,
+			       (unsigned long long) seqno_page->signaled[1 - parity]);
+			sleep(1);
+		}
+	}
+
+	// each user owns a slot and signals every update to it
+	// (the slot is freed when the device is closed)
+	if (use_sub) {
+		struct dmapp_sub_args sub_args = {
+			.size = sizeof(uint64_t),
+		};
+		ret = ioctl(fd, DMAPP_IOCTL_SUB_ALLOC, &sub_args);
+		if (ret == -1) {
+			printf("dmapp: DMAPP_IOCTL_SUB_ALLOC failed: %s\n",
+			       strerror(errno));
+			goto fail_forward;
+		}
+
+		uint64_t* slot = (uint64_t*) ((uint8_t*) buf + sub_args.offset);
+		uint64_t count = 0;
+
+		// a child shares the slot and waits for each update
+		// without taking the buffer lock
+		if (fork() == 0) {
+			struct dmapp_sub_args wait_args = sub_args;
+			wait_args.seqno = 0;
+			wait_args.timeout_ns = DMAPP_TIMEOUT_NS;
+			while (1) {
+				ret = ioctl(fd, DMAPP_IOCTL_SUB_WAIT, &wait_args);
+				if ((ret == -1) && (errno == ETIMEDOUT)) {
+					continue;
+				} else if (ret == -1) {
+					printf("dmapp: DMAPP_IOCTL_SUB_WAIT failed: %s\n",
+					       strerror(errno));
+					exit(EXIT_FAILURE);
+				}
+
+				printf("sub(%i): seqno=%llu count=%llu\n", parity,
+				       (unsigned long long) wait_args.seqno,
+				       (unsigned long long) *slot);
+			}
+		}
+
+		while (1) {
+			*slot = count++;
+			ret = ioctl(fd, DMAPP_IOCTL_SUB_SIGNAL, &sub_args);
+			if (ret == -1) {
+				printf("dmapp: DMAPP_IOCTL_SUB_SIGNAL failed\n");
+				break;
+			}
+
+			printf("sub(%i): offset=%u seqno=%llu\n", parity,
+			       sub_args.offset, (unsigned long long) sub_args.seqno);
+			usleep(DMAPP_SLEEP_DURATION);
+		}
+
+		ioctl(fd, DMAPP_IOCTL_SUB_FREE, &sub_args);
+		goto fail_forward;
+	}
+
+	// the odd user produces a counter after initializing the
+	// ring and the even user consumes it once the odd user
+	// hands over the lock
+	if (use_stream) {
+		struct dmapp_ring* ring = (struct dmapp_ring*) buf;
+		long page_size = sysconf(_SC_PAGESIZE);
+		uint8_t* data = (uint8_t*) buf + page_size;
+		int mirrored = 0;
+		uint64_t msg = 0;
+
 		ret = ioctl(fd, DMAPP_IOCTL_BUFFER_LOCK);
+		if ((ret == 0) && parity) {
+			ret = ioctl(fd, DMAPP_IOCTL_RING_INIT);
+			if (ret > 0) {
+				ret = ioctl(fd, DMAPP_IOCTL_BUFFER_UNLOCK);
+			}
+		}
+		if ((ret < 0) && (errno == ENOSPC)) {
+			// the ring needs a header page and a data page
+			printf("dmapp: stream requires buffer_size >= %i\n",
+			       (int) (2 * page_size / sizeof(int)));
+			goto fail_forward;
+		} else if (ret < 0) {
+			printf("dmapp: stream setup failed\n");
+			goto fail_forward;
+		}
+
+		// map the ring data twice to avoid splitting records
+		void* mirror = mmap(NULL, 2 * ring->size,
+		                    PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+		                    DMAPP_MMAP_MIRROR + page_size);
+		if (mirror != MAP_FAILED) {
+			data = mirror;
+			mirrored = 1;
+		}
+
+		while (1) {
+			if (parity) {
+				dmapp_ring_write(fd, ring, data, mirrored, &msg,
+				                 sizeof(msg));
+			} else {
+				dmapp_ring_read(fd, ring, data, mirrored, &msg,
+				                sizeof(msg));
+			}
+
+			if ((msg % 1000000) == 0) {
+				printf("stream(%i): msg=%llu\n", parity,
+				       (unsigned long long) msg);
+			}
+			++msg;
+		}
+	}
+
+	// read each frame while the writers wait for us to finish
+	while (use_reader) {
+		struct dmapp_read_args read_args = {
+			.timeout_ns = DMAPP_TIMEOUT_NS,
+		};
+		ret = ioctl(fd, DMAPP_IOCTL_READ_LOCK, &read_args);
 		if (ret == -1) {
+			printf("dmapp: DMAPP_IOCTL_READ_LOCK failed: %s\n",
+			       strerror(errno));
+			continue;
+		}
+
+		printf("frame(%llu): ", (unsigned long long) read_args.frame);
+		for (i = 0; i < size; ++i) {
+			printf("%i", buf[i]);
+		}
+		printf("\n");
+
+		ret = ioctl(fd, DMAPP_IOCTL_READ_UNLOCK);
+		if (ret == -1) {
+			printf("dmapp: DMAPP_IOCTL_READ_UNLOCK failed\n");
+		}
+	}
+
+	// the buffer is held from the swap until it is unlocked
+	// by the engine, a skipped frame or a metadata unlock
+	int locked = 0;
+	uint32_t pass = 0;
+	uint32_t tiles = 1;
+	while (1) {
+		// report when the swap is expected to block which is
+		// only known once the buffer is no longer held since
+		// the peer cannot signal our turn before then
+		if (!locked && !dmapp_turn_ready(seqno_page, parity)) {
+			printf("dmapp: waiting for seqno=%llu\n",
+				(unsigned long long) seqno_page->pending[parity]);
+		}
+
+		// the tiles of our next turn are signaled as the peer
+		// writes them and all of them once it unlocks
+		if (use_tiles && !locked) {
+			dmapp_tiles_read(fd, buf, parity, &tiles);
+		}
+
+		// unlock the previous pass (if any) and lock the buffer
+		// for the next pass with a single ioctl while hinting
+		// that we expect the buffer within two frames
+		struct dmapp_lock_args lock_args = {
+			.timeout_ns = DMAPP_TIMEOUT_NS,
+			.deadline_ns = dmapp_time_ns() + 2000LL * DMAPP_SLEEP_DURATION,
+		};
+		ret = ioctl(fd, DMAPP_IOCTL_BUFFER_SWAP_TIMEOUT, &lock_args);
+		if ((ret == -1) && (errno == ETIMEDOUT)) {
+			// keep waiting for a slow peer
+			printf("dmapp: DMAPP_IOCTL_BUFFER_SWAP_TIMEOUT timeout\n");
+			continue;
+		} else if (ret == -1) {
 			// retry on lock failures
-			printf("dmapp: DMAPP_IOCTL_BUFFER_LOCK failed\n");
+			printf("dmapp: DMAPP_IOCTL_BUFFER_SWAP_TIMEOUT failed\n");
 			usleep(DMAPP_SLEEP_DURATION);
 			continue;
 		}
+		locked = 1;
+
+		// the peer record is current when it was published for
+		// the turn which we just locked where the acquire load
+		// pairs with the release of signaled by the peer unlock
+		if (use_meta) {
+			struct dmapp_meta_args* meta = &meta_page->meta[1 - parity];
+			uint64_t signaled = __atomic_load_n(&seqno_page->signaled[parity],
+				__ATOMIC_ACQUIRE);
+			if (meta->frame == signaled) {
+				printf("meta(%i): frame=%llu timestamp_ns=%llu flags=0x%x\n",
+				       1 - parity, (unsigned long long) meta->frame,
+				       (unsigned long long) meta->timestamp_ns,
+				       meta->flags);
+				if (meta->flags & DMAPP_META_FLAG_SKIP) {
+					ret = ioctl(fd, DMAPP_IOCTL_BUFFER_UNLOCK);
+					locked = (ret == -1);
+					continue;
+				}
+			}
+		}
+
+		if (use_damage) {
+			struct dmapp_damage_args damage_args;
+			ret = ioctl(fd, DMAPP_IOCTL_GET_DAMAGE, &damage_args);
+			if (ret == -1) {
+				printf("dmapp: DMAPP_IOCTL_GET_DAMAGE failed\n");
+			} else if (damage_args.flags & DMAPP_DAMAGE_ALL) {
+				printf("damage(%i): all\n", 1 - parity);
+			} else {
+				uint32_t r;
+				for (r = 0; r < damage_args.count; ++r) {
+					printf("damage(%i): offset=%u count=%u\n", 1 - parity,
+					       damage_args.ranges[r].offset,
+					       damage_args.ranges[r].count);
+				}
+			}
+		}
 
 		// print input
 		printf("in(%i): ", 1 - parity);
@@ -103,8 +1321,40 @@ int main(int argc, char** argv) {
 		}
 		printf("\n");
 
+		// let the kernel engine do the work and hand the buffer
+		// to the peer once it completes
+		if (use_engine) {
+			struct dmapp_job_args job_args = {
+				.op = DMAPP_JOB_INCREMENT,
+				.flags = DMAPP_JOB_UNLOCK,
+				.src_fd = -1,
+				.value = 1,
+				.priority = DMAPP_JOB_PRIORITY_HIGH,
+			};
+			ret = ioctl(fd, DMAPP_IOCTL_JOB_SUBMIT, &job_args);
+			if (ret == -1) {
+				printf("dmapp: DMAPP_IOCTL_JOB_SUBMIT failed\n");
+			} else {
+				close(job_args.fence_fd);
+				locked = 0;
+			}
+			continue;
+		}
+
+		// hand the buffer to the peer a tile at a time
+		if (use_tiles) {
+			dmapp_tiles_write(fd, buf, size, tiles);
+			ret = ioctl(fd, DMAPP_IOCTL_BUFFER_UNLOCK);
+			locked = (ret == -1);
+			continue;
+		}
+
 		// do some work
 		usleep(DMAPP_SLEEP_DURATION);
+		uint32_t offset = pass++ % size;
+		if (use_damage) {
+			++buf[offset];
+		}
 
 		// print output
 		printf("out(%i): ", parity);
@@ -113,15 +1363,44 @@ int main(int argc, char** argv) {
 		}
 		printf("\n");
 
-		// unlock buffer
-		ret = ioctl(fd, DMAPP_IOCTL_BUFFER_UNLOCK);
-		if (ret == -1) {
-			// warn on unlock failures
-			printf("dmapp: warning DMAPP_IOCTL_BUFFER_UNLOCK failed\n");
+		// describe the frame as we hand it to the peer
+		if (use_meta) {
+			struct dmapp_meta_args meta_args = {
+				.flags = (seqno_page->pending[parity] % 2) ?
+				         DMAPP_META_FLAG_SKIP : 0,
+			};
+			ret = ioctl(fd, DMAPP_IOCTL_BUFFER_UNLOCK_META, &meta_args);
+			if (ret == -1) {
+				printf("dmapp: DMAPP_IOCTL_BUFFER_UNLOCK_META failed\n");
+			} else {
+				locked = 0;
+			}
+		}
+
+		// describe the change as we hand the buffer to the peer
+		if (use_damage) {
+			struct dmapp_damage_args damage_args = {
+				.count = 1,
+				.ranges = { { .offset = offset, .count = 1 } },
+			};
+			ret = ioctl(fd, DMAPP_IOCTL_BUFFER_UNLOCK_DAMAGE, &damage_args);
+			if (ret == -1) {
+				printf("dmapp: DMAPP_IOCTL_BUFFER_UNLOCK_DAMAGE failed\n");
+			} else {
+				locked = 0;
+			}
 		}
 	}
 
-	// Unmap the DMA buffer
+	// Unmap the metadata page, seqno page and DMA buffer
+	if (munmap(meta_page, sizeof(struct dmapp_meta_page)) == -1) {
+		printf("dmapp: munmap meta page failed: %s\n", strerror(errno));
+	}
+
+	if (munmap(seqno_page, sizeof(struct dmapp_seqno_page)) == -1) {
+		printf("dmapp: munmap seqno page failed: %s\n", strerror(errno));
+	}
+
 	if (munmap(buf, size_bytes) == -1) {
 		printf("dmapp: munmap failed: %s\n", strerror(errno));
 	}
@@ -131,6 +1410,12 @@ int main(int argc, char** argv) {
 
 	return EXIT_SUCCESS;
 
+	fail_forward:
+		munmap(meta_page, sizeof(struct dmapp_meta_page));
+	fail_mmap_meta_page:
+		munmap(seqno_page, sizeof(struct dmapp_seqno_page));
+	fail_mmap_seqno_page:
+		munmap(buf, size_bytes);
 	fail_mmap:
 		close(dma_buf_fd);
 	fail_dma_buf_fd:
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2024 Jeff Boody
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+
+#include <string.h>
+
+#include "dmapp_block.h"
+
+static uint32_t dmapp_block_min(uint32_t a, uint32_t b) {
+	return (a < b) ? a : b;
+}
+
+size_t dmapp_block_size(uint32_t stride, uint32_t height) {
+	uint32_t rows = (height + DMAPP_BLOCK_HEIGHT - 1) &
+	                ~(DMAPP_BLOCK_HEIGHT - 1);
+	return (size_t) stride * rows;
+}
+
+void dmapp_block_from_linear(uint8_t* dst, uint32_t stride,
+                             const uint8_t* src, uint32_t src_stride,
+                             uint32_t width, uint32_t height) {
+	uint32_t x;
+	uint32_t y;
+	for (y = 0; y < height; ++y) {
+		for (x = 0; x < width; x += DMAPP_BLOCK_WIDTH) {
+			memcpy(dst + dmapp_block_offset(stride, x, y),
+			       src + (size_t) y * src_stride + x,
+			       dmapp_block_min(DMAPP_BLOCK_WIDTH, width - x));
+		}
+	}
+}
+
+void dmapp_block_to_linear(uint8_t* dst, uint32_t dst_stride,
+                           const uint8_t* src, uint32_t stride,
+                           uint32_t width, uint32_t height) {
+	uint32_t x;
+	uint32_t y;
+	for (y = 0; y < height; ++y) {
+		for (x = 0; x < width; x += DMAPP_BLOCK_WIDTH) {
+			memcpy(dst + (size_t) y * dst_stride + x,
+			       src + dmapp_block_offset(stride, x, y),
+			       dmapp_block_min(DMAPP_BLOCK_WIDTH, width - x));
+		}
+	}
+}
+
+void dmapp_block_filter3x3_linear(uint8_t* dst, const uint8_t* src,
+                                  uint32_t stride, uint32_t width,
+                                  uint32_t height) {
+	uint32_t x;
+	uint32_t y;
+	for (y = 1; y + 1 < height; ++y) {
+		const uint8_t* r0 = src + (size_t) (y - 1) * stride;
+		const uint8_t* r1 = r0 + stride;
+		const uint8_t* r2 = r1 + stride;
+		uint8_t*       d  = dst + (size_t) y * stride;
+		for (x = 1; x + 1 < width; ++x) {
+			d[x] = (r0[x - 1] + r0[x] + r0[x + 1] +
+			        r1[x - 1] + r1[x] + r1[x + 1] +
+			        r2[x - 1] + r2[x] + r2[x + 1]) / 9;
+		}
+	}
+}
+
+// dst and src share the blocked layout and the filter walks
+// one block at a time so that the block and its neighbors
+// stay in cache, the first and last rows of a block read the
+// last and first rows of the blocks above and below which
+// are a row of blocks apart and the first and last columns
+// read the blocks to the left and right which are adjacent
+// in memory
+#define DMAPP_BLOCK_LEFT  (DMAPP_BLOCK_WIDTH - 1 - DMAPP_BLOCK_SIZE)
+#define DMAPP_BLOCK_RIGHT DMAPP_BLOCK_SIZE
+
+void dmapp_block_filter3x3_blocked(uint8_t* dst, const uint8_t* src,
+                                   uint32_t stride, uint32_t width,
+                                   uint32_t height) {
+	size_t   block_row = (size_t) stride * DMAPP_BLOCK_HEIGHT;
+	size_t   up        = block_row - DMAPP_BLOCK_SIZE;
+	uint32_t tx;
+	uint32_t ty;
+	uint32_t i;
+	uint32_t j;
+	for (ty = 0; ty < height; ty += DMAPP_BLOCK_HEIGHT) {
+		// row j of the block row at y = ty + j
+		uint32_t j0 = (ty == 0) ? 1 : 0;
+		uint32_t j1 = dmapp_block_min(DMAPP_BLOCK_HEIGHT,
+		                              height - 1 - ty);
+		for (tx = 0; tx < width; tx += DMAPP_BLOCK_WIDTH) {
+			const uint8_t* s = src + dmapp_block_offset(stride, tx, ty);
+			uint8_t*       t = dst + dmapp_block_offset(stride, tx, ty);
+
+			// column i of the block row at x = tx + i
+			uint32_t i1 = dmapp_block_min(DMAPP_BLOCK_WIDTH - 1,
+			                              width - 1 - tx);
+			for (j = j0; j < j1; ++j) {
+				const uint8_t* r1 = s + j * DMAPP_BLOCK_WIDTH;
+				const uint8_t* r0 = r1 - DMAPP_BLOCK_WIDTH;
+				const uint8_t* r2 = r1 + DMAPP_BLOCK_WIDTH;
+				uint8_t*       d  = t + j * DMAPP_BLOCK_WIDTH;
+				if (j == 0) {
+					r0 -= up;
+				}
+				if (j == DMAPP_BLOCK_HEIGHT - 1) {
+					r2 += up;
+				}
+
+				for (i = 1; i < i1; ++i) {
+					d[i] = (r0[i - 1] + r0[i] + r0[i + 1] +
+					        r1[i - 1] + r1[i] + r1[i + 1] +
+					        r2[i - 1] + r2[i] + r2[i + 1]) / 9;
+				}
+
+				if ((tx > 0) && (tx + 1 < width)) {
+					d[0] = (r0[DMAPP_BLOCK_LEFT] + r0[0] + r0[1] +
+					        r1[DMAPP_BLOCK_LEFT] + r1[0] + r1[1] +
+					        r2[DMAPP_BLOCK_LEFT] + r2[0] + r2[1]) / 9;
+				}
+
+				i = DMAPP_BLOCK_WIDTH - 1;
+				if (tx + i + 1 < width) {
+					d[i] = (r0[i - 1] + r0[i] + r0[DMAPP_BLOCK_RIGHT] +
+					        r1[i - 1] + r1[i] + r1[DMAPP_BLOCK_RIGHT] +
+					        r2[i - 1] + r2[i] + r2[DMAPP_BLOCK_RIGHT]) / 9;
+				}
+			}
+		}
+	}
+}
+
+void dmapp_block_column_sum_linear(uint32_t* sums, const uint8_t* src,
+                                   uint32_t stride, uint32_t width,
+                                   uint32_t height) {
+	uint32_t x;
+	uint32_t y;
+	for (x = 0; x < width; ++x) {
+		const uint8_t* s   = src + x;
+		uint32_t       sum = 0;
+		for (y = 0; y < height; ++y) {
+			sum += *s;
+			s   += stride;
+		}
+		sums[x] = sum;
+	}
+}
+
+// the rows of a block column are DMAPP_BLOCK_WIDTH apart and
+// consecutive blocks of a column are a row of blocks apart
+void dmapp_block_column_sum_blocked(uint32_t* sums, const uint8_t* src,
+                                    uint32_t stride, uint32_t width,
+                                    uint32_t height) {
+	size_t   block_row = (size_t) stride * DMAPP_BLOCK_HEIGHT;
+	uint32_t x;
+	uint32_t y;
+	uint32_t j;
+	for (x = 0; x < width; ++x) {
+		const uint8_t* t   = src + dmapp_block_offset(stride, x, 0);
+		uint32_t       sum = 0;
+		for (y = 0; y < height; y += DMAPP_BLOCK_HEIGHT) {
+			const uint8_t* s    = t;
+			uint32_t       rows = dmapp_block_min(DMAPP_BLOCK_HEIGHT,
+			                                      height - y);
+			for (j = 0; j < rows; ++j) {
+				sum += *s;
+				s   += DMAPP_BLOCK_WIDTH;
+			}
+			t += block_row;
+		}
+		sums[x] = sum;
+	}
+}
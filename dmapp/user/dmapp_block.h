@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2024 Jeff Boody
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+
+#ifndef dmapp_block_H
+#define dmapp_block_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// blocked planes are stored as 64 byte x 64 row blocks in
+// row-major block order with row-major bytes in each block
+#define DMAPP_BLOCK_WIDTH  64
+#define DMAPP_BLOCK_HEIGHT 64
+#define DMAPP_BLOCK_SIZE   (DMAPP_BLOCK_WIDTH * DMAPP_BLOCK_HEIGHT)
+
+// offset of the byte at (x, y) of a blocked plane where the
+// stride is the padded row size in bytes
+static inline size_t dmapp_block_offset(uint32_t stride, uint32_t x,
+                                        uint32_t y) {
+	size_t block = (size_t) (y / DMAPP_BLOCK_HEIGHT) *
+	               (stride / DMAPP_BLOCK_WIDTH) + x / DMAPP_BLOCK_WIDTH;
+	return block * DMAPP_BLOCK_SIZE +
+	       (y % DMAPP_BLOCK_HEIGHT) * DMAPP_BLOCK_WIDTH +
+	       x % DMAPP_BLOCK_WIDTH;
+}
+
+// size of a blocked plane (height is padded to whole blocks)
+size_t dmapp_block_size(uint32_t stride, uint32_t height);
+
+// convert width bytes x height rows between a linear plane
+// and a blocked plane
+void dmapp_block_from_linear(uint8_t* dst, uint32_t stride,
+                             const uint8_t* src, uint32_t src_stride,
+                             uint32_t width, uint32_t height);
+void dmapp_block_to_linear(uint8_t* dst, uint32_t dst_stride,
+                           const uint8_t* src, uint32_t stride,
+                           uint32_t width, uint32_t height);
+
+// 3x3 box filter of an 8-bit plane which leaves the border
+// pixels of dst untouched
+void dmapp_block_filter3x3_linear(uint8_t* dst, const uint8_t* src,
+                                  uint32_t stride, uint32_t width,
+                                  uint32_t height);
+void dmapp_block_filter3x3_blocked(uint8_t* dst, const uint8_t* src,
+                                   uint32_t stride, uint32_t width,
+                                   uint32_t height);
+
+// sum each column of an 8-bit plane by walking down the
+// columns which touches a new page every few rows of a
+// linear plane but only every 64 rows of a blocked plane
+void dmapp_block_column_sum_linear(uint32_t* sums, const uint8_t* src,
+                                   uint32_t stride, uint32_t width,
+                                   uint32_t height);
+void dmapp_block_column_sum_blocked(uint32_t* sums, const uint8_t* src,
+                                    uint32_t stride, uint32_t width,
+                                    uint32_t height);
+
+#endif